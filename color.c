@@ -1,8 +1,14 @@
+#include <pthread.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #include "types.h"
 #include "color.h"
 #include "math.h"
+#include "simd.h"
 
-/* NOTE: no gamma-correction */
+/* NOTE: no gamma-correction, see srgbblend for that */
 Color blend(Color b, Color t)
 {
 	U8 rc = divround(R(b)*(255-A(t)) + R(t)*A(t), 255);
@@ -24,3 +30,666 @@ Color compose(Color b, Color t)
 	U8 bc = divround((255 - A(t))*A(b)*B(b) + A(t)*B(t)*255, ac);
 	return RGBA(rc, gc, bc, divround(ac, 255));
 }
+
+/* NOTE: span kernels below are bit-exact with blend, including the
+ * fact that it always produces zero alpha */
+
+void fillspan(Color *d, Color c, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i v8 = _mm256_set1_epi32(c);
+	for (; k + 8 <= n; k += 8)
+		_mm256_storeu_si256((__m256i *)(d + k), v8);
+#endif
+#if defined(__SSE2__)
+	__m128i v4 = _mm_set1_epi32(c);
+	for (; k + 4 <= n; k += 4)
+		_mm_storeu_si128((__m128i *)(d + k), v4);
+#endif
+	for (; k < n; k++)
+		d[k] = c;
+}
+
+/* NOTE: for v <= 255*255 the rounded division by 255 can be done
+ * as (v + 128 + ((v + 128) >> 8)) >> 8, which fits into 16 bits */
+#define DIV255(v) (((v) + 128 + (((v) + 128) >> 8)) >> 8)
+
+void blendfill(Color *d, Color c, U64 n)
+{
+	U32 a = A(c), ia = 255 - a;
+	if (a == 255) {
+		fillspan(d, SETA(c, 0), n);
+		return;
+	}
+	U64 k = 0;
+	if (a == 0) {
+		for (; k < n; k++)
+			d[k] = SETA(d[k], 0);
+		return;
+	}
+	/* NOTE: the vector paths have the rounding term folded into the color */
+	U16 tr = R(c)*a + 128, tg = G(c)*a + 128, tb = B(c)*a + 128;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i m8 = _mm256_set_epi16(0, ia, ia, ia, 0, ia, ia, ia, 0, ia, ia, ia, 0, ia, ia, ia);
+	__m256i t8 = _mm256_set_epi16(0, tr, tg, tb, 0, tr, tg, tb, 0, tr, tg, tb, 0, tr, tg, tb);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), m8), t8);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), m8), t8);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i m4 = _mm_set_epi16(0, ia, ia, ia, 0, ia, ia, ia);
+	__m128i t4 = _mm_set_epi16(0, tr, tg, tb, 0, tr, tg, tb);
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), m4), t4);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), m4), t4);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; k < n; k++) {
+		U32 rc = R(d[k])*ia + R(c)*a, gc = G(d[k])*ia + G(c)*a, bc = B(d[k])*ia + B(c)*a;
+		d[k] = RGBA(DIV255(rc), DIV255(gc), DIV255(bc), 0);
+	}
+}
+
+/* NOTE: the coverage scales the source alpha, zero coverage
+ * leaves the destination pixel untouched */
+void blendspan(Color *d, Color c, U8 *cov, U64 n)
+{
+	U32 as = A(c);
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i ff8 = _mm256_set1_epi16(255);
+	__m256i r8 = _mm256_set1_epi16(128);
+	__m256i s8 = _mm256_set_epi16(0, R(c), G(c), B(c), 0, R(c), G(c), B(c), 0, R(c), G(c), B(c), 0, R(c), G(c), B(c));
+	__m256i rgb8 = _mm256_set1_epi32(0x00FFFFFF);
+	for (; k + 8 <= n; k += 8) {
+		__m128i cv = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(cov + k)));
+		__m128i av = _mm_add_epi16(_mm_mullo_epi16(cv, _mm_set1_epi16(as)), _mm_set1_epi16(128));
+		av = _mm_srli_epi16(_mm_add_epi16(av, _mm_srli_epi16(av, 8)), 8);
+		/* NOTE: spread per-pixel values over the channel lanes, the pixel order must
+		 * match the one of unpacklo/unpackhi, which work within 128-bit halves */
+		__m256i a2 = _mm256_setr_m128i(_mm_unpacklo_epi16(av, av), _mm_unpackhi_epi16(av, av));
+		__m256i c2 = _mm256_setr_m128i(_mm_unpacklo_epi16(cv, cv), _mm_unpackhi_epi16(cv, cv));
+		__m256i alo = _mm256_unpacklo_epi32(a2, a2), ahi = _mm256_unpackhi_epi32(a2, a2);
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), _mm256_sub_epi16(ff8, alo));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), _mm256_sub_epi16(ff8, ahi));
+		lo = _mm256_add_epi16(_mm256_add_epi16(lo, _mm256_mullo_epi16(s8, alo)), r8);
+		hi = _mm256_add_epi16(_mm256_add_epi16(hi, _mm256_mullo_epi16(s8, ahi)), r8);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		__m256i y = _mm256_and_si256(_mm256_packus_epi16(lo, hi), rgb8);
+		__m256i keep = _mm256_cmpeq_epi32(c2, z8);
+		y = _mm256_or_si256(_mm256_and_si256(keep, x), _mm256_andnot_si256(keep, y));
+		_mm256_storeu_si256((__m256i *)(d + k), y);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i ff4 = _mm_set1_epi16(255);
+	__m128i r4 = _mm_set1_epi16(128);
+	__m128i s4 = _mm_set_epi16(0, R(c), G(c), B(c), 0, R(c), G(c), B(c));
+	__m128i rgb4 = _mm_set1_epi32(0x00FFFFFF);
+	for (; k + 4 <= n; k += 4) {
+		U32 cw;
+		__builtin_memcpy(&cw, cov + k, 4);
+		__m128i cv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cw), z4);
+		__m128i av = _mm_add_epi16(_mm_mullo_epi16(cv, _mm_set1_epi16(as)), r4);
+		av = _mm_srli_epi16(_mm_add_epi16(av, _mm_srli_epi16(av, 8)), 8);
+		__m128i a2 = _mm_unpacklo_epi16(av, av), c2 = _mm_unpacklo_epi16(cv, cv);
+		__m128i alo = _mm_unpacklo_epi32(a2, a2), ahi = _mm_unpackhi_epi32(a2, a2);
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), _mm_sub_epi16(ff4, alo));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), _mm_sub_epi16(ff4, ahi));
+		lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_mullo_epi16(s4, alo)), r4);
+		hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_mullo_epi16(s4, ahi)), r4);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		__m128i y = _mm_and_si128(_mm_packus_epi16(lo, hi), rgb4);
+		__m128i keep = _mm_cmpeq_epi32(c2, z4);
+		y = _mm_or_si128(_mm_and_si128(keep, x), _mm_andnot_si128(keep, y));
+		_mm_storeu_si128((__m128i *)(d + k), y);
+	}
+#endif
+	for (; k < n; k++) {
+		if (!cov[k])
+			continue;
+		U32 a = DIV255(as*cov[k]), ia = 255 - a;
+		U32 rc = R(d[k])*ia + R(c)*a, gc = G(d[k])*ia + G(c)*a, bc = B(d[k])*ia + B(c)*a;
+		d[k] = RGBA(DIV255(rc), DIV255(gc), DIV255(bc), 0);
+	}
+}
+
+#if defined(__AVX2__)
+/* NOTE: rounded division of 8 lanes, done in doubles which is exact here:
+ * the quotient is at least 1/y away from the next integer, which is
+ * way more than the rounding error of a 25-bit numerator */
+static __m256i divround8(__m256i x, __m256i y)
+{
+	x = _mm256_add_epi32(x, _mm256_srli_epi32(y, 1));
+	__m128i lo = _mm256_cvttpd_epi32(_mm256_div_pd(
+		_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)),
+		_mm256_cvtepi32_pd(_mm256_castsi256_si128(y))));
+	__m128i hi = _mm256_cvttpd_epi32(_mm256_div_pd(
+		_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)),
+		_mm256_cvtepi32_pd(_mm256_extracti128_si256(y, 1))));
+	return _mm256_setr_m128i(lo, hi);
+}
+#endif
+
+#if defined(__SSE2__)
+/* NOTE: the SSE2 version of divround8, for 4 lanes */
+static __m128i divround4(__m128i x, __m128i y)
+{
+	x = _mm_add_epi32(x, _mm_srli_epi32(y, 1));
+	__m128i lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(x), _mm_cvtepi32_pd(y)));
+	__m128i hi = _mm_cvttpd_epi32(_mm_div_pd(
+		_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), _mm_cvtepi32_pd(_mm_srli_si128(y, 8))));
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+#endif
+
+/* NOTE: same coverage semantics as in blendspan */
+void composespan(Color *d, Color c, U8 *cov, U64 n)
+{
+	U32 as = A(c);
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i ff8 = _mm256_set1_epi32(255);
+	__m256i r8 = _mm256_set1_epi32(128);
+	__m256i rt8 = _mm256_set1_epi32(R(c)*255);
+	__m256i gt8 = _mm256_set1_epi32(G(c)*255);
+	__m256i bt8 = _mm256_set1_epi32(B(c)*255);
+	for (; k + 8 <= n; k += 8) {
+		__m256i cv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(cov + k)));
+		__m256i at = _mm256_add_epi32(_mm256_mullo_epi32(cv, _mm256_set1_epi32(as)), r8);
+		at = _mm256_srli_epi32(_mm256_add_epi32(at, _mm256_srli_epi32(at, 8)), 8);
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i ab = _mm256_srli_epi32(x, 24);
+		__m256i w = _mm256_mullo_epi32(_mm256_sub_epi32(ff8, at), ab);
+		__m256i ac = _mm256_sub_epi32(_mm256_mullo_epi32(_mm256_add_epi32(ab, at), ff8), _mm256_mullo_epi32(ab, at));
+		__m256i rb = _mm256_and_si256(_mm256_srli_epi32(x, 16), ff8);
+		__m256i gb = _mm256_and_si256(_mm256_srli_epi32(x, 8), ff8);
+		__m256i bb = _mm256_and_si256(x, ff8);
+		__m256i rc = divround8(_mm256_add_epi32(_mm256_mullo_epi32(w, rb), _mm256_mullo_epi32(at, rt8)), ac);
+		__m256i gc = divround8(_mm256_add_epi32(_mm256_mullo_epi32(w, gb), _mm256_mullo_epi32(at, gt8)), ac);
+		__m256i bc = divround8(_mm256_add_epi32(_mm256_mullo_epi32(w, bb), _mm256_mullo_epi32(at, bt8)), ac);
+		__m256i a = _mm256_add_epi32(ac, r8);
+		a = _mm256_srli_epi32(_mm256_add_epi32(a, _mm256_srli_epi32(a, 8)), 8);
+		__m256i y = _mm256_or_si256(
+			_mm256_or_si256(_mm256_slli_epi32(a, 24), _mm256_slli_epi32(rc, 16)),
+			_mm256_or_si256(_mm256_slli_epi32(gc, 8), bc));
+		y = _mm256_andnot_si256(_mm256_cmpeq_epi32(ac, z8), y);
+		__m256i keep = _mm256_cmpeq_epi32(cv, z8);
+		y = _mm256_or_si256(_mm256_and_si256(keep, x), _mm256_andnot_si256(keep, y));
+		_mm256_storeu_si256((__m256i *)(d + k), y);
+	}
+#endif
+#if defined(__SSE2__)
+	/* NOTE: without 32-bit multiplies everything but the numerators stays
+	 * in 16-bit lanes, where ac = w + 255*at fits as well. The numerators
+	 * come out of mullo/mulhi pairs. */
+	__m128i z4 = _mm_setzero_si128();
+	__m128i ff4 = _mm_set1_epi16(255);
+	__m128i r4 = _mm_set1_epi16(128);
+	__m128i t4[3] = {_mm_set1_epi16(R(c)*255), _mm_set1_epi16(G(c)*255), _mm_set1_epi16(B(c)*255)};
+	for (; k + 8 <= n; k += 8) {
+		__m128i cv = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(cov + k)), z4);
+		__m128i at = _mm_add_epi16(_mm_mullo_epi16(cv, _mm_set1_epi16(as)), r4);
+		at = _mm_srli_epi16(_mm_add_epi16(at, _mm_srli_epi16(at, 8)), 8);
+		__m128i x0 = _mm_loadu_si128((__m128i *)(d + k)), x1 = _mm_loadu_si128((__m128i *)(d + k + 4));
+		__m128i w = _mm_mullo_epi16(_mm_sub_epi16(ff4, at), chan16(x0, x1, 24));
+		__m128i ac = _mm_add_epi16(w, _mm_mullo_epi16(at, ff4));
+		__m128i aclo = _mm_unpacklo_epi16(ac, z4), achi = _mm_unpackhi_epi16(ac, z4);
+		__m128i a = _mm_add_epi16(ac, r4);
+		a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+		__m128i ylo = _mm_slli_epi32(_mm_unpacklo_epi16(a, z4), 24);
+		__m128i yhi = _mm_slli_epi32(_mm_unpackhi_epi16(a, z4), 24);
+		for (int j = 0; j < 3; j++) {
+			__m128i b = chan16(x0, x1, 16 - 8*j);
+			__m128i p = _mm_mullo_epi16(w, b), ph = _mm_mulhi_epu16(w, b);
+			__m128i q = _mm_mullo_epi16(at, t4[j]), qh = _mm_mulhi_epu16(at, t4[j]);
+			__m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(p, ph), _mm_unpacklo_epi16(q, qh));
+			__m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(p, ph), _mm_unpackhi_epi16(q, qh));
+			ylo = _mm_or_si128(ylo, _mm_slli_epi32(divround4(lo, aclo), 16 - 8*j));
+			yhi = _mm_or_si128(yhi, _mm_slli_epi32(divround4(hi, achi), 16 - 8*j));
+		}
+		__m128i zero = _mm_cmpeq_epi16(ac, z4), keep = _mm_cmpeq_epi16(cv, z4);
+		ylo = _mm_andnot_si128(_mm_unpacklo_epi16(zero, zero), ylo);
+		yhi = _mm_andnot_si128(_mm_unpackhi_epi16(zero, zero), yhi);
+		__m128i klo = _mm_unpacklo_epi16(keep, keep), khi = _mm_unpackhi_epi16(keep, keep);
+		ylo = _mm_or_si128(_mm_and_si128(klo, x0), _mm_andnot_si128(klo, ylo));
+		yhi = _mm_or_si128(_mm_and_si128(khi, x1), _mm_andnot_si128(khi, yhi));
+		_mm_storeu_si128((__m128i *)(d + k), ylo);
+		_mm_storeu_si128((__m128i *)(d + k + 4), yhi);
+	}
+#endif
+	for (; k < n; k++)
+		if (cov[k])
+			d[k] = compose(d[k], SETA(c, DIV255(as*cov[k])));
+}
+
+/* NOTE: Premultiplied colors have r, g, b already scaled by a, so putting
+ * t over b is t + b*(255 - A(t))/255 for all four channels, the alpha
+ * of the result is meaningful and there is no division by it, unlike in
+ * compose. The kernels below are bit-exact with premul and pmblend. */
+Color premul(Color c)
+{
+	U32 a = A(c);
+	return RGBA(DIV255(R(c)*a), DIV255(G(c)*a), DIV255(B(c)*a), a);
+}
+
+Color unpremul(Color c)
+{
+	U32 a = A(c);
+	if (a == 0)
+		return 0;
+	U32 rc = (R(c)*255 + a/2)/a, gc = (G(c)*255 + a/2)/a, bc = (B(c)*255 + a/2)/a;
+	return RGBA(MIN(rc, 255u), MIN(gc, 255u), MIN(bc, 255u), a);
+}
+
+Color pmblend(Color b, Color t)
+{
+	U32 ia = 255 - A(t);
+	U8 rc = R(t) + DIV255(R(b)*ia);
+	U8 gc = G(t) + DIV255(G(b)*ia);
+	U8 bc = B(t) + DIV255(B(b)*ia);
+	U8 ac = A(t) + DIV255(A(b)*ia);
+	return RGBA(rc, gc, bc, ac);
+}
+
+void premulspan(Color *d, U64 n)
+{
+	for (U64 k = 0; k < n; k++)
+		d[k] = premul(d[k]);
+}
+
+void unpremulspan(Color *d, U64 n)
+{
+	for (U64 k = 0; k < n; k++)
+		d[k] = unpremul(d[k]);
+}
+
+void pmblendfill(Color *d, Color c, U64 n)
+{
+	U16 ia = 255 - A(c);
+	if (ia == 0) {
+		fillspan(d, c, n);
+		return;
+	}
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i m8 = _mm256_set1_epi16(ia);
+	__m256i r8 = _mm256_set1_epi16(128);
+	__m256i s8 = _mm256_unpacklo_epi8(_mm256_set1_epi32(c), z8);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), m8), r8);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), m8), r8);
+		lo = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8), s8);
+		hi = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8), s8);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i m4 = _mm_set1_epi16(ia);
+	__m128i r4 = _mm_set1_epi16(128);
+	__m128i s4 = _mm_unpacklo_epi8(_mm_set1_epi32(c), z4);
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), m4), r4);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), m4), r4);
+		lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8), s4);
+		hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8), s4);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = pmblend(d[k], c);
+}
+
+/* NOTE: the coverage scales all four channels of the source, since the
+ * result of zero coverage is b*255/255, such pixels stay untouched */
+void pmblendspan(Color *d, Color c, U8 *cov, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i ff8 = _mm256_set1_epi16(255);
+	__m256i r8 = _mm256_set1_epi16(128);
+	__m256i s8 = _mm256_unpacklo_epi8(_mm256_set1_epi32(c), z8);
+	for (; k + 8 <= n; k += 8) {
+		__m128i cv = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(cov + k)));
+		__m256i c2 = _mm256_setr_m128i(_mm_unpacklo_epi16(cv, cv), _mm_unpackhi_epi16(cv, cv));
+		__m256i slo = _mm256_add_epi16(_mm256_mullo_epi16(s8, _mm256_unpacklo_epi32(c2, c2)), r8);
+		__m256i shi = _mm256_add_epi16(_mm256_mullo_epi16(s8, _mm256_unpackhi_epi32(c2, c2)), r8);
+		slo = _mm256_srli_epi16(_mm256_add_epi16(slo, _mm256_srli_epi16(slo, 8)), 8);
+		shi = _mm256_srli_epi16(_mm256_add_epi16(shi, _mm256_srli_epi16(shi, 8)), 8);
+		/* NOTE: alpha of the scaled source spread over its pixel's lanes */
+		__m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), _mm256_sub_epi16(ff8, alo));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), _mm256_sub_epi16(ff8, ahi));
+		lo = _mm256_add_epi16(lo, r8), hi = _mm256_add_epi16(hi, r8);
+		lo = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8), slo);
+		hi = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8), shi);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i ff4 = _mm_set1_epi16(255);
+	__m128i r4 = _mm_set1_epi16(128);
+	__m128i s4 = _mm_unpacklo_epi8(_mm_set1_epi32(c), z4);
+	for (; k + 4 <= n; k += 4) {
+		U32 cw;
+		__builtin_memcpy(&cw, cov + k, 4);
+		__m128i cv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cw), z4);
+		__m128i c2 = _mm_unpacklo_epi16(cv, cv);
+		__m128i slo = _mm_add_epi16(_mm_mullo_epi16(s4, _mm_unpacklo_epi32(c2, c2)), r4);
+		__m128i shi = _mm_add_epi16(_mm_mullo_epi16(s4, _mm_unpackhi_epi32(c2, c2)), r4);
+		slo = _mm_srli_epi16(_mm_add_epi16(slo, _mm_srli_epi16(slo, 8)), 8);
+		shi = _mm_srli_epi16(_mm_add_epi16(shi, _mm_srli_epi16(shi, 8)), 8);
+		__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), _mm_sub_epi16(ff4, alo));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), _mm_sub_epi16(ff4, ahi));
+		lo = _mm_add_epi16(lo, r4), hi = _mm_add_epi16(hi, r4);
+		lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8), slo);
+		hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8), shi);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; k < n; k++) {
+		U32 v = cov[k];
+		Color s = RGBA(DIV255(R(c)*v), DIV255(G(c)*v), DIV255(B(c)*v), DIV255(A(c)*v));
+		d[k] = pmblend(d[k], s);
+	}
+}
+
+/* NOTE: per channel (a*(256 - f) + b*f + 128)/256, done for two channels
+ * at once in a 32-bit register, since none of them can overflow 16 bits */
+Color lerpcolor(Color a, Color b, U32 f)
+{
+	U32 rb = ((a & 0xFF00FF)*(256 - f) + (b & 0xFF00FF)*f + 0x800080) >> 8;
+	U32 ag = ((a >> 8 & 0xFF00FF)*(256 - f) + (b >> 8 & 0xFF00FF)*f + 0x800080) >> 8;
+	return (rb & 0xFF00FF) | (ag & 0xFF00FF) << 8;
+}
+
+void lerpspan(Color *d, Color *a, Color *b, U32 f, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i fa8 = _mm256_set1_epi16(256 - f), fb8 = _mm256_set1_epi16(f);
+	__m256i r8 = _mm256_set1_epi16(128);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(a + k));
+		__m256i y = _mm256_loadu_si256((__m256i *)(b + k));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), fa8), r8);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), fa8), r8);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(y, z8), fb8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(y, z8), fb8)), 8);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i fa4 = _mm_set1_epi16(256 - f), fb4 = _mm_set1_epi16(f);
+	__m128i r4 = _mm_set1_epi16(128);
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(a + k));
+		__m128i y = _mm_loadu_si128((__m128i *)(b + k));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), fa4), r4);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), fa4), r4);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(y, z4), fb4)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(y, z4), fb4)), 8);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = lerpcolor(a[k], b[k], f);
+}
+
+/* NOTE: d[k] is lerpcolor(s[x[k]], s[x[k] + 1], f[k]), both pixels of
+ * a pair are loaded at once and weighted in the two halves of a register */
+void lerpgather(Color *d, Color *s, U32 *x, U8 *f, U64 n)
+{
+	U64 k = 0;
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i r4 = _mm_set1_epi16(128);
+	/* NOTE: weights are (256 - f) in the low half and f in the high one,
+	 * the latter is -(0 - f), negated as ~v + 1 */
+	__m128i base4 = _mm_set_epi16(0, 0, 0, 0, 256, 256, 256, 256);
+	__m128i neg4 = _mm_set_epi16(-1, -1, -1, -1, 0, 0, 0, 0);
+	__m128i one4 = _mm_set_epi16(1, 1, 1, 1, 0, 0, 0, 0);
+	for (; k + 2 <= n; k += 2) {
+		__m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(s + x[k])), z4);
+		__m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(s + x[k+1])), z4);
+		__m128i f0 = _mm_sub_epi16(base4, _mm_set1_epi16(f[k]));
+		__m128i f1 = _mm_sub_epi16(base4, _mm_set1_epi16(f[k+1]));
+		f0 = _mm_add_epi16(_mm_xor_si128(f0, neg4), one4);
+		f1 = _mm_add_epi16(_mm_xor_si128(f1, neg4), one4);
+		p0 = _mm_mullo_epi16(p0, f0), p1 = _mm_mullo_epi16(p1, f1);
+		__m128i y = _mm_add_epi16(_mm_unpacklo_epi64(p0, p1), _mm_unpackhi_epi64(p0, p1));
+		y = _mm_srli_epi16(_mm_add_epi16(y, r4), 8);
+		_mm_storel_epi64((__m128i *)(d + k), _mm_packus_epi16(y, y));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = lerpcolor(s[x[k]], s[x[k] + 1], f[k]);
+}
+
+/* NOTE: blends every s[k] over d[k] with its own alpha, bit-exact with blend */
+void blendrow(Color *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i ff8 = _mm256_set1_epi16(255);
+	__m256i r8 = _mm256_set1_epi16(128);
+	__m256i rgb8 = _mm256_set1_epi32(0x00FFFFFF);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i y = _mm256_loadu_si256((__m256i *)(s + k));
+		__m256i slo = _mm256_unpacklo_epi8(y, z8), shi = _mm256_unpackhi_epi8(y, z8);
+		__m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), _mm256_sub_epi16(ff8, alo));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), _mm256_sub_epi16(ff8, ahi));
+		lo = _mm256_add_epi16(_mm256_add_epi16(lo, _mm256_mullo_epi16(slo, alo)), r8);
+		hi = _mm256_add_epi16(_mm256_add_epi16(hi, _mm256_mullo_epi16(shi, ahi)), r8);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_and_si256(_mm256_packus_epi16(lo, hi), rgb8));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i ff4 = _mm_set1_epi16(255);
+	__m128i r4 = _mm_set1_epi16(128);
+	__m128i rgb4 = _mm_set1_epi32(0x00FFFFFF);
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i y = _mm_loadu_si128((__m128i *)(s + k));
+		__m128i slo = _mm_unpacklo_epi8(y, z4), shi = _mm_unpackhi_epi8(y, z4);
+		__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), _mm_sub_epi16(ff4, alo));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), _mm_sub_epi16(ff4, ahi));
+		lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_mullo_epi16(slo, alo)), r4);
+		hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_mullo_epi16(shi, ahi)), r4);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_and_si128(_mm_packus_epi16(lo, hi), rgb4));
+	}
+#endif
+	for (; k < n; k++) {
+		U32 a = A(s[k]), ia = 255 - a;
+		U32 rc = R(d[k])*ia + R(s[k])*a, gc = G(d[k])*ia + G(s[k])*a, bc = B(d[k])*ia + B(s[k])*a;
+		d[k] = RGBA(DIV255(rc), DIV255(gc), DIV255(bc), 0);
+	}
+}
+
+/* NOTE: bit-exact with pmblend for every pair */
+void pmblendrow(Color *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i z8 = _mm256_setzero_si256();
+	__m256i ff8 = _mm256_set1_epi16(255);
+	__m256i r8 = _mm256_set1_epi16(128);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(d + k));
+		__m256i y = _mm256_loadu_si256((__m256i *)(s + k));
+		__m256i slo = _mm256_unpacklo_epi8(y, z8), shi = _mm256_unpackhi_epi8(y, z8);
+		__m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z8), _mm256_sub_epi16(ff8, alo));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z8), _mm256_sub_epi16(ff8, ahi));
+		lo = _mm256_add_epi16(lo, r8), hi = _mm256_add_epi16(hi, r8);
+		lo = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8), slo);
+		hi = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8), shi);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i z4 = _mm_setzero_si128();
+	__m128i ff4 = _mm_set1_epi16(255);
+	__m128i r4 = _mm_set1_epi16(128);
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(d + k));
+		__m128i y = _mm_loadu_si128((__m128i *)(s + k));
+		__m128i slo = _mm_unpacklo_epi8(y, z4), shi = _mm_unpackhi_epi8(y, z4);
+		__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(x, z4), _mm_sub_epi16(ff4, alo));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(x, z4), _mm_sub_epi16(ff4, ahi));
+		lo = _mm_add_epi16(lo, r4), hi = _mm_add_epi16(hi, r4);
+		lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8), slo);
+		hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8), shi);
+		_mm_storeu_si128((__m128i *)(d + k), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = pmblend(d[k], s[k]);
+}
+
+/* NOTE: sRGB blending decodes both colors to linear light with a table,
+ * mixes them there and encodes the result back with another, bigger table,
+ * since 8 bits are way too few for the dark end of linear values. The alpha
+ * is stretched to 0..256 so the mixing is a shift, and decoding followed
+ * by encoding is lossless, so a = 0 and a = 255 give exact colors. */
+#define LINBITS 12
+#define LINMAX ((1 << LINBITS) - 1)
+
+static U32 srgbdec[256];
+static U8  srgbenc[LINMAX + 1];
+static pthread_once_t srgbonce = PTHREAD_ONCE_INIT;
+
+/* NOTE: y^5 = x by Newton's method, from above */
+static F64 root5(F64 x)
+{
+	F64 y = 1;
+	for (U8 k = 0; k < 32; k++)
+		y -= (y - x/(y*y*y*y))/5;
+	return y;
+}
+
+static void srgbbuild(void)
+{
+	for (U32 s = 0; s < 256; s++) {
+		F64 x = s/255.0, l = x/12.92;
+		if (x > 0.04045) {
+			F64 y = root5((x + 0.055)/1.055), y4 = SQUARE(SQUARE(y));
+			l = y4*y4*y4;
+		}
+		srgbdec[s] = l*LINMAX + .5;
+	}
+	for (U32 l = 0; l <= LINMAX; l++) {
+		F64 x = (F64)l/LINMAX, e = x*12.92;
+		if (x > 0.0031308) {
+			F64 y = fcbrt(fsqrt(fsqrt(x)));
+			e = 1.055*SQUARE(SQUARE(y))*y - 0.055;
+		}
+		srgbenc[l] = MIN(e, 1)*255 + .5;
+	}
+	for (U32 s = 0; s < 256; s++)
+		srgbenc[srgbdec[s]] = s;
+}
+
+void srgbinit(void)
+{
+	pthread_once(&srgbonce, srgbbuild);
+}
+
+static U32 srgbmix(U32 b, U32 t, U32 a)
+{
+	return srgbenc[(srgbdec[b]*(256 - a) + srgbdec[t]*a + 128) >> 8];
+}
+
+Color srgbblend(Color b, Color t)
+{
+	U32 a = A(t) + (A(t) >> 7);
+	return RGBA(srgbmix(R(b), R(t), a), srgbmix(G(b), G(t), a), srgbmix(B(b), B(t), a), 0);
+}
+
+/* NOTE: With a constant source every channel of the result depends only
+ * on the same channel of the destination, so for long enough spans it's
+ * cheaper to tabulate all 256 of them first. Gathers were tried for the
+ * lookups and turned out slower than the scalar code. */
+void srgbblendfill(Color *d, Color c, U64 n)
+{
+	srgbinit();
+	U32 a = A(c) + (A(c) >> 7);
+	if (a == 256) {
+		fillspan(d, SETA(c, 0), n);
+		return;
+	}
+	if (n < 256) {
+		for (U64 k = 0; k < n; k++)
+			d[k] = srgbblend(d[k], c);
+		return;
+	}
+	Color rt[256], gt[256], bt[256];
+	for (U32 v = 0; v < 256; v++) {
+		rt[v] = RGBA(srgbmix(v, R(c), a), 0, 0, 0);
+		gt[v] = RGBA(0, srgbmix(v, G(c), a), 0, 0);
+		bt[v] = RGBA(0, 0, srgbmix(v, B(c), a), 0);
+	}
+	for (U64 k = 0; k < n; k++)
+		d[k] = rt[R(d[k])] | gt[G(d[k])] | bt[B(d[k])];
+}
+
+/* NOTE: the coverage scales the source alpha as in blendspan */
+void srgbblendspan(Color *d, Color c, U8 *cov, U64 n)
+{
+	srgbinit();
+	U32 as = A(c);
+	for (U64 k = 0; k < n; k++) {
+		if (!cov[k])
+			continue;
+		U32 a = DIV255(as*cov[k]);
+		a += a >> 7;
+		d[k] = RGBA(srgbmix(R(d[k]), R(c), a), srgbmix(G(d[k]), G(c), a), srgbmix(B(d[k]), B(c), a), 0);
+	}
+}
@@ -27,3 +27,34 @@ typedef U32 Color;
 
 Color blend(Color b, Color t);
 Color compose(Color b, Color t);
+
+void  fillspan(Color *d, Color c, U64 n);
+void  blendfill(Color *d, Color c, U64 n);
+void  blendspan(Color *d, Color c, U8 *cov, U64 n);
+void  composespan(Color *d, Color c, U8 *cov, U64 n);
+void  blendrow(Color *d, Color *s, U64 n);
+
+/* NOTE: f is the weight of b, out of 256 */
+Color lerpcolor(Color a, Color b, U32 f);
+void  lerpspan(Color *d, Color *a, Color *b, U32 f, U64 n);
+void  lerpgather(Color *d, Color *s, U32 *x, U8 *f, U64 n);
+
+/* NOTE: premultiplied alpha */
+Color premul(Color c);
+Color unpremul(Color c);
+Color pmblend(Color b, Color t);
+
+void  premulspan(Color *d, U64 n);
+void  unpremulspan(Color *d, U64 n);
+void  pmblendfill(Color *d, Color c, U64 n);
+void  pmblendspan(Color *d, Color c, U8 *cov, U64 n);
+void  pmblendrow(Color *d, Color *s, U64 n);
+
+/* NOTE: blending in linear light, the colors are sRGB encoded straight alpha.
+ * srgbblend needs the tables built by srgbinit (only the first call builds
+ * them), the span kernels call it themselves. */
+void  srgbinit(void);
+Color srgbblend(Color b, Color t);
+
+void  srgbblendfill(Color *d, Color c, U64 n);
+void  srgbblendspan(Color *d, Color c, U8 *cov, U64 n);
@@ -0,0 +1,259 @@
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+#include "color.h"
+#include "conv.h"
+#include "simd.h"
+
+/* NOTE: 8.8 fixed point weights of R, G, B and the offset with the
+ * rounding term folded in. Every result lands in 0..65535, so the vector
+ * paths can do the sums in wrapping 16-bit lanes. */
+#define KY    66, 129, 25, 128 + (16<<8)
+#define KCB   -38, -74, 112, 128 + (128<<8)
+#define KCR   112, -94, -18, 128 + (128<<8)
+#define KGRAY 77, 150, 29, 128
+
+static U8 weigh(U32 r, U32 g, U32 b, I32 kr, I32 kg, I32 kb, I32 o)
+{
+	return (kr*(I32)r + kg*(I32)g + kb*(I32)b + o) >> 8;
+}
+
+U8 toy(Color c)    { return weigh(R(c), G(c), B(c), KY); }
+U8 tocb(Color c)   { return weigh(R(c), G(c), B(c), KCB); }
+U8 tocr(Color c)   { return weigh(R(c), G(c), B(c), KCR); }
+U8 togray(Color c) { return weigh(R(c), G(c), B(c), KGRAY); }
+
+void swaprb(Color *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i ga8 = _mm256_set1_epi32(0xFF00FF00), c8 = _mm256_set1_epi32(0xFF);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(s + k));
+		__m256i rb = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(x, 16), c8),
+			_mm256_slli_epi32(_mm256_and_si256(x, c8), 16));
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_or_si256(_mm256_and_si256(x, ga8), rb));
+	}
+#endif
+#if defined(__SSE2__)
+	for (; k + 4 <= n; k += 4)
+		_mm_storeu_si128((__m128i *)(d + k), swaprb4(_mm_loadu_si128((__m128i *)(s + k))));
+#endif
+	for (; k < n; k++)
+		d[k] = RGBA(B(s[k]), G(s[k]), R(s[k]), A(s[k]));
+}
+
+void reversespan(Color *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i m8 = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)(s + k));
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_shuffle_epi8(x, m8));
+	}
+#endif
+#if defined(__SSE2__)
+	/* NOTE: swap the 16-bit halves, then the bytes inside of them */
+	for (; k + 4 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(s + k));
+		x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *)(d + k), x);
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = __builtin_bswap32(s[k]);
+}
+
+#if defined(__SSE2__)
+static inline __m128i weigh8(__m128i r, __m128i g, __m128i b, I16 kr, I16 kg, I16 kb, I32 o)
+{
+	__m128i v = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+	v = _mm_add_epi16(v, _mm_mullo_epi16(b, _mm_set1_epi16(kb)));
+	return _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16((U16)o)), 8);
+}
+
+static inline void store8(U8 *d, __m128i v)
+{
+	_mm_storel_epi64((__m128i *)d, _mm_packus_epi16(v, v));
+}
+#endif
+
+void toycc444(U8 *y, U8 *cb, U8 *cr, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__SSE2__)
+	for (; k + 8 <= n; k += 8) {
+		__m128i a = _mm_loadu_si128((__m128i *)(s + k));
+		__m128i b = _mm_loadu_si128((__m128i *)(s + k + 4));
+		__m128i rc = chan16(a, b, 16), gc = chan16(a, b, 8), bc = chan16(a, b, 0);
+		store8(y + k, weigh8(rc, gc, bc, KY));
+		store8(cb + k, weigh8(rc, gc, bc, KCB));
+		store8(cr + k, weigh8(rc, gc, bc, KCR));
+	}
+#endif
+	for (; k < n; k++) {
+		y[k] = toy(s[k]);
+		cb[k] = tocb(s[k]);
+		cr[k] = tocr(s[k]);
+	}
+}
+
+void tograyspan(U8 *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__SSE2__)
+	for (; k + 8 <= n; k += 8) {
+		__m128i a = _mm_loadu_si128((__m128i *)(s + k));
+		__m128i b = _mm_loadu_si128((__m128i *)(s + k + 4));
+		store8(d + k, weigh8(chan16(a, b, 16), chan16(a, b, 8), chan16(a, b, 0), KGRAY));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = togray(s[k]);
+}
+
+static void tolumaspan(U8 *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__SSE2__)
+	for (; k + 8 <= n; k += 8) {
+		__m128i a = _mm_loadu_si128((__m128i *)(s + k));
+		__m128i b = _mm_loadu_si128((__m128i *)(s + k + 4));
+		store8(d + k, weigh8(chan16(a, b, 16), chan16(a, b, 8), chan16(a, b, 0), KY));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = toy(s[k]);
+}
+
+void toycc420(U8 *y0, U8 *y1, U8 *cb, U8 *cr, Color *s0, Color *s1, U64 n)
+{
+	tolumaspan(y0, s0, n);
+	tolumaspan(y1, s1, n);
+	U64 k = 0;
+#if defined(__SSE2__)
+	/* NOTE: 16 columns of both rows make 8 chroma samples, the horizontal
+	 * pairs are summed with madd */
+	__m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+	for (; 2*k + 16 <= n; k += 8) {
+		Color *p = s0 + 2*k, *q = s1 + 2*k;
+		__m128i a0 = _mm_loadu_si128((__m128i *)p), a1 = _mm_loadu_si128((__m128i *)(p + 4));
+		__m128i a2 = _mm_loadu_si128((__m128i *)(p + 8)), a3 = _mm_loadu_si128((__m128i *)(p + 12));
+		__m128i b0 = _mm_loadu_si128((__m128i *)q), b1 = _mm_loadu_si128((__m128i *)(q + 4));
+		__m128i b2 = _mm_loadu_si128((__m128i *)(q + 8)), b3 = _mm_loadu_si128((__m128i *)(q + 12));
+		__m128i c[3];
+		for (int j = 0; j < 3; j++) {
+			int sh = 16 - 8*j;
+			__m128i lo = _mm_madd_epi16(_mm_add_epi16(chan16(a0, a1, sh), chan16(b0, b1, sh)), one);
+			__m128i hi = _mm_madd_epi16(_mm_add_epi16(chan16(a2, a3, sh), chan16(b2, b3, sh)), one);
+			c[j] = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), two), 2);
+		}
+		store8(cb + k, weigh8(c[0], c[1], c[2], KCB));
+		store8(cr + k, weigh8(c[0], c[1], c[2], KCR));
+	}
+#endif
+	for (; 2*k < n; k++) {
+		U64 x0 = 2*k, x1 = x0 + 1 < n ? x0 + 1 : x0;
+		Color p = s0[x0], q = s0[x1], u = s1[x0], v = s1[x1];
+		Color c = RGBA(
+			(R(p) + R(q) + R(u) + R(v) + 2) >> 2,
+			(G(p) + G(q) + G(u) + G(v) + 2) >> 2,
+			(B(p) + B(q) + B(u) + B(v) + 2) >> 2, 0);
+		cb[k] = tocb(c);
+		cr[k] = tocr(c);
+	}
+}
+
+void packrgb(U8 *d, Color *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	/* NOTE: each lane packs 4 pixels into its low 12 bytes, the 4 bytes of
+	 * garbage after the second lane get overwritten by the next pixels */
+	__m256i m8 = _mm256_set_epi8(
+		-1, -1, -1, -1, 12, 13, 14, 8, 9, 10, 4, 5, 6, 0, 1, 2,
+		-1, -1, -1, -1, 12, 13, 14, 8, 9, 10, 4, 5, 6, 0, 1, 2);
+	for (; k + 10 <= n; k += 8) {
+		__m256i x = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(s + k)), m8);
+		_mm_storeu_si128((__m128i *)(d + 3*k), _mm256_castsi256_si128(x));
+		_mm_storeu_si128((__m128i *)(d + 3*k + 12), _mm256_extracti128_si256(x, 1));
+	}
+#endif
+#if defined(__SSE2__)
+	/* NOTE: without pshufb the alpha bytes are squeezed out with shifts,
+	 * first inside of the 64-bit lanes, then between them */
+	__m128i p0 = _mm_set1_epi64x(0xFFFFFF), p1 = _mm_set1_epi64x(0xFFFFFF00000000);
+	__m128i l0 = _mm_set_epi64x(0, -1), l1 = _mm_set_epi64x(-1, 0);
+	for (; k + 6 <= n; k += 4) {
+		__m128i x = swaprb4(_mm_loadu_si128((__m128i *)(s + k)));
+		x = _mm_or_si128(_mm_and_si128(x, p0), _mm_srli_epi64(_mm_and_si128(x, p1), 8));
+		x = _mm_or_si128(_mm_and_si128(x, l0), _mm_srli_si128(_mm_and_si128(x, l1), 2));
+		_mm_storeu_si128((__m128i *)(d + 3*k), x);
+	}
+#endif
+	for (; k < n; k++) {
+		d[3*k+0] = R(s[k]);
+		d[3*k+1] = G(s[k]);
+		d[3*k+2] = B(s[k]);
+	}
+}
+
+void unpackrgb(Color *d, U8 *s, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	__m256i m8 = _mm256_set_epi8(
+		-1, 9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2,
+		-1, 9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2);
+	__m256i a8 = _mm256_set1_epi32(0xFF000000);
+	for (; k + 10 <= n; k += 8) {
+		__m128i lo = _mm_loadu_si128((__m128i *)(s + 3*k));
+		__m128i hi = _mm_loadu_si128((__m128i *)(s + 3*k + 12));
+		__m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_or_si256(_mm256_shuffle_epi8(x, m8), a8));
+	}
+#endif
+#if defined(__SSE2__)
+	/* NOTE: the reverse of the SSE2 path of packrgb */
+	__m128i a4 = _mm_set1_epi32(0xFF000000);
+	__m128i p0 = _mm_set1_epi64x(0xFFFFFF), p1 = _mm_set1_epi64x(0xFFFFFF000000);
+	__m128i l0 = _mm_set_epi64x(0, -1), l1 = _mm_set_epi64x(-1, 0);
+	for (; k + 6 <= n; k += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)(s + 3*k));
+		x = _mm_or_si128(_mm_and_si128(x, l0), _mm_and_si128(_mm_slli_si128(x, 2), l1));
+		x = _mm_or_si128(_mm_and_si128(x, p0), _mm_slli_epi64(_mm_and_si128(x, p1), 8));
+		_mm_storeu_si128((__m128i *)(d + k), _mm_or_si128(swaprb4(x), a4));
+	}
+#endif
+	for (; k < n; k++)
+		d[k] = RGBA(s[3*k+0], s[3*k+1], s[3*k+2], 255);
+}
+
+void palexpand(Color *d, U8 *s, Color *pal, U64 n)
+{
+	U64 k = 0;
+#if defined(__AVX2__)
+	for (; k + 8 <= n; k += 8) {
+		__m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(s + k)));
+		_mm256_storeu_si256((__m256i *)(d + k), _mm256_i32gather_epi32((int *)pal, x, 4));
+	}
+#endif
+	/* NOTE: there is no gather before AVX2, but reading the indices 8 at
+	 * a time keeps the loads and the lookups independent */
+	for (; k + 8 <= n; k += 8) {
+		U64 x;
+		__builtin_memcpy(&x, s + k, 8);
+		d[k+0] = pal[x & 0xFF], d[k+1] = pal[x >> 8 & 0xFF];
+		d[k+2] = pal[x >> 16 & 0xFF], d[k+3] = pal[x >> 24 & 0xFF];
+		d[k+4] = pal[x >> 32 & 0xFF], d[k+5] = pal[x >> 40 & 0xFF];
+		d[k+6] = pal[x >> 48 & 0xFF], d[k+7] = pal[x >> 56];
+	}
+	for (; k < n; k++)
+		d[k] = pal[s[k]];
+}
@@ -0,0 +1,24 @@
+/* NOTE: pixel format conversions, one row at a time. The per-pixel
+ * functions are the reference, the span kernels are bit-exact with them.
+ * YCbCr is BT.601 with the studio range (Y in 16..235), gray is full range. */
+U8   toy(Color c);
+U8   tocb(Color c);
+U8   tocr(Color c);
+U8   togray(Color c);
+
+/* NOTE: d can be the same as s */
+void swaprb(Color *d, Color *s, U64 n);      /* BGRA <-> RGBA in memory */
+void reversespan(Color *d, Color *s, U64 n); /* BGRA <-> ARGB in memory */
+
+void toycc444(U8 *y, U8 *cb, U8 *cr, Color *s, U64 n);
+/* NOTE: two rows go in, cb and cr get (n+1)/2 samples of the averaged 2x2
+ * blocks. For an odd height pass the last row as both s0 and s1. */
+void toycc420(U8 *y0, U8 *y1, U8 *cb, U8 *cr, Color *s0, Color *s1, U64 n);
+void tograyspan(U8 *d, Color *s, U64 n);
+
+/* NOTE: RGB24 is 3 bytes per pixel in the R, G, B order, as in PPM */
+void packrgb(U8 *d, Color *s, U64 n);
+void unpackrgb(Color *d, U8 *s, U64 n);
+
+/* NOTE: d[k] = pal[s[k]], pal has to have all 256 entries */
+void palexpand(Color *d, U8 *s, Color *pal, U64 n);
@@ -0,0 +1,484 @@
+#include <pthread.h>
+
+#include "types.h"
+#include "math.h"
+#include "deflate.h"
+
+/* NOTE: slicing by 8, the tables are built on the first use */
+static U32 crctab[8][256];
+static pthread_once_t crconce = PTHREAD_ONCE_INIT;
+
+static void crcinit(void)
+{
+	for (U32 k = 0; k < 256; k++) {
+		U32 c = k;
+		for (U32 j = 0; j < 8; j++)
+			c = c & 1 ? 0xEDB88320 ^ c >> 1 : c >> 1;
+		crctab[0][k] = c;
+	}
+	for (U32 k = 0; k < 256; k++)
+		for (U32 t = 1; t < 8; t++)
+			crctab[t][k] = crctab[t-1][k] >> 8 ^ crctab[0][crctab[t-1][k] & 0xFF];
+}
+
+U32 crc32update(U32 crc, U8 *p, U64 n)
+{
+	pthread_once(&crconce, crcinit);
+	crc = ~crc;
+	for (; n >= 8; n -= 8, p += 8) {
+		U32 a = crc ^ (p[0] | p[1]<<8 | p[2]<<16 | (U32)p[3]<<24);
+		U32 b = p[4] | p[5]<<8 | p[6]<<16 | (U32)p[7]<<24;
+		crc = crctab[7][a & 0xFF] ^ crctab[6][a>>8 & 0xFF] ^ crctab[5][a>>16 & 0xFF] ^ crctab[4][a>>24] ^
+			crctab[3][b & 0xFF] ^ crctab[2][b>>8 & 0xFF] ^ crctab[1][b>>16 & 0xFF] ^ crctab[0][b>>24];
+	}
+	for (; n; n--, p++)
+		crc = crctab[0][(crc ^ *p) & 0xFF] ^ crc >> 8;
+	return ~crc;
+}
+
+#define ADLERMOD 65521
+#define ADLERMAX 5552 /* NOTE: bytes before the sums can overflow */
+
+U32 adler32update(U32 a, U8 *p, U64 n)
+{
+	U32 s1 = a & 0xFFFF, s2 = a >> 16;
+	while (n) {
+		U64 m = MIN(n, (U64)ADLERMAX);
+		n -= m;
+		for (; m; m--) {
+			s1 += *p++;
+			s2 += s1;
+		}
+		s1 %= ADLERMOD;
+		s2 %= ADLERMOD;
+	}
+	return s2<<16 | s1;
+}
+
+U32 adler32combine(U32 a, U32 b, U64 nb)
+{
+	U32 r = nb%ADLERMOD, s1 = a & 0xFFFF;
+	U32 s2 = (U64)r*s1%ADLERMOD;
+	s1 += (b & 0xFFFF) + ADLERMOD - 1;
+	s2 += (a >> 16) + (b >> 16) + ADLERMOD - r;
+	s1 = s1 >= ADLERMOD ? s1 - ADLERMOD : s1;
+	s1 = s1 >= ADLERMOD ? s1 - ADLERMOD : s1;
+	s2 = s2 >= 2*ADLERMOD ? s2 - 2*ADLERMOD : s2;
+	s2 = s2 >= ADLERMOD ? s2 - ADLERMOD : s2;
+	return s2<<16 | s1;
+}
+
+#define HASHBITS    15
+#define WINDOW      32768
+#define BLOCKTOKENS 16384
+#define MINMATCH    3
+#define MAXMATCH    258
+#define NLIT        286
+#define NDIST       30
+
+typedef struct {
+	U8  *p;
+	U64 n;
+	U64 acc;
+	U32 nacc;
+	U8  *ps; /* NOTE: stored blocks wait here to be merged with the next ones */
+	U64 pn;
+} Bits;
+
+/* NOTE: the bits go in from the low end, whole words come out */
+static void putbits(Bits *b, U32 v, U32 n)
+{
+	b->acc |= (U64)v << b->nacc;
+	b->nacc += n;
+	if (b->nacc >= 32) {
+		for (U32 k = 0; k < 4; k++)
+			b->p[b->n++] = b->acc >> 8*k;
+		b->acc >>= 32;
+		b->nacc -= 32;
+	}
+}
+
+static void alignbits(Bits *b)
+{
+	for (; b->nacc > 0; b->nacc = b->nacc > 8 ? b->nacc - 8 : 0) {
+		b->p[b->n++] = b->acc;
+		b->acc >>= 8;
+	}
+	b->acc = 0;
+}
+
+static void putstored(Bits *b, U8 *s, U64 n, OK final)
+{
+	do {
+		U32 k = MIN(n, (U64)65535);
+		n -= k;
+		putbits(b, final && !n, 1);
+		putbits(b, 0, 2);
+		alignbits(b);
+		U8 h[4] = {k, k >> 8, ~k, ~k >> 8};
+		__builtin_memcpy(b->p + b->n, h, 4);
+		__builtin_memcpy(b->p + b->n + 4, s, k);
+		b->n += 4 + k;
+		s += k;
+	} while (n);
+}
+
+static U64 storedbits(U64 n)
+{
+	return (n/65535 + 1)*(3 + 7 + 32) + 8*n;
+}
+
+static void flushstored(Bits *b, OK final)
+{
+	if (b->ps)
+		putstored(b, b->ps, b->pn, final);
+	b->ps = 0;
+	b->pn = 0;
+}
+
+typedef struct {
+	U16 code[288]; /* NOTE: bit-reversed, ready for putbits */
+	U8  len[288];
+} Huff;
+
+/* NOTE: Huffman code lengths with the two-queue method over the sorted
+ * frequencies; when the code gets longer than maxlen the frequencies are
+ * flattened and it's built again */
+static void hufflens(U32 *freq, U32 n, U8 *len, U32 maxlen)
+{
+	U32 f[288], sym[288], w[2*288], parent[2*288], depth[2*288];
+	__builtin_memcpy(f, freq, n*sizeof(f[0]));
+	for (;;) {
+		U32 m = 0;
+		for (U32 k = 0; k < n; k++) {
+			len[k] = 0;
+			if (f[k])
+				sym[m++] = k;
+		}
+		if (m <= 1) {
+			if (m)
+				len[sym[0]] = 1;
+			return;
+		}
+		for (U32 k = 1; k < m; k++)
+			for (U32 j = k; j > 0 && f[sym[j-1]] > f[sym[j]]; j--) {
+				U32 t = sym[j];
+				sym[j] = sym[j-1];
+				sym[j-1] = t;
+			}
+		for (U32 k = 0; k < m; k++)
+			w[k] = f[sym[k]];
+		U32 leaf = 0, node = m, nn = m;
+		for (U32 k = 0; k + 1 < m; k++) {
+			U32 pick[2];
+			for (U32 j = 0; j < 2; j++)
+				pick[j] = leaf < m && (node == nn || w[leaf] <= w[node]) ? leaf++ : node++;
+			w[nn] = w[pick[0]] + w[pick[1]];
+			parent[pick[0]] = parent[pick[1]] = nn++;
+		}
+		/* NOTE: parents always come after their children */
+		U32 max = 0;
+		depth[nn-1] = 0;
+		for (U32 k = nn - 1; k-- > 0;) {
+			depth[k] = depth[parent[k]] + 1;
+			max = k < m ? MAX(max, depth[k]) : max;
+		}
+		if (max <= maxlen) {
+			for (U32 k = 0; k < m; k++)
+				len[sym[k]] = depth[k];
+			return;
+		}
+		for (U32 k = 0; k < n; k++)
+			f[k] = f[k] ? f[k]>>1 | 1 : 0;
+	}
+}
+
+static void huffcodes(Huff *h, U32 n)
+{
+	U32 count[16] = {0}, next[16] = {0}, c = 0;
+	for (U32 k = 0; k < n; k++)
+		count[h->len[k]] += 1;
+	count[0] = 0;
+	for (U32 b = 1; b < 16; b++)
+		next[b] = c = (c + count[b-1]) << 1;
+	for (U32 k = 0; k < n; k++) {
+		U32 l = h->len[k], v = l ? next[l]++ : 0, r = 0;
+		for (U32 j = 0; j < l; j++)
+			r |= (v >> j & 1) << (l - 1 - j);
+		h->code[k] = r;
+	}
+}
+
+static void fixedhuff(Huff *lit, Huff *dist)
+{
+	for (U32 k = 0; k < 288; k++)
+		lit->len[k] = k < 144 ? 8 : k < 256 ? 9 : k < 280 ? 7 : 8;
+	for (U32 k = 0; k < 32; k++)
+		dist->len[k] = 5;
+	huffcodes(lit, 288);
+	huffcodes(dist, 32);
+}
+
+/* NOTE: tokens are literal bytes or len<<16 | dist */
+static U32 lencode(U32 len, U32 *extra, U32 *nextra)
+{
+	U32 l = len - MINMATCH;
+	*extra = *nextra = 0;
+	if (len == MAXMATCH)
+		return 285;
+	if (l < 8)
+		return 257 + l;
+	U32 k = 31 - __builtin_clz(l);
+	*nextra = k - 2;
+	*extra = l & ((1U << (k - 2)) - 1);
+	return 257 + 4*(k - 1) + (l >> (k - 2) & 3);
+}
+
+static U32 distcode(U32 dist, U32 *extra, U32 *nextra)
+{
+	U32 d = dist - 1;
+	*extra = *nextra = 0;
+	if (d < 4)
+		return d;
+	U32 k = 31 - __builtin_clz(d);
+	*nextra = k - 1;
+	*extra = d & ((1U << (k - 1)) - 1);
+	return 2*k + (d >> (k - 1) & 1);
+}
+
+static U64 blockbits(U32 *lf, U32 *df, U8 *ll, U8 *dl)
+{
+	U64 bits = 0;
+	for (U32 k = 0; k < NLIT; k++)
+		bits += (U64)lf[k]*(ll[k] + (k >= 265 && k < 285 ? (k - 261)/4 : 0));
+	for (U32 k = 0; k < NDIST; k++)
+		bits += (U64)df[k]*(dl[k] + (k >= 4 ? k/2 - 1 : 0));
+	return bits;
+}
+
+static const U8 clorder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+typedef struct {
+	Huff lit, dist, cl;
+	U8   rs[NLIT + NDIST], rx[NLIT + NDIST];
+	U32  nr, nl, nd, ncl;
+} Dynamic;
+
+/* NOTE: builds the codes of a dynamic block and the run-length coded
+ * lengths for its header, returns the size of the header in bits */
+static U64 dynamic(Dynamic *y, U32 *lf, U32 *df)
+{
+	U32 dfs[NDIST], used = 0;
+	__builtin_memcpy(dfs, df, sizeof(dfs));
+	for (U32 k = 0; k < NDIST; k++)
+		used += dfs[k] != 0;
+	if (!used)
+		dfs[0] = 1;
+	hufflens(lf, NLIT, y->lit.len, 15);
+	hufflens(dfs, NDIST, y->dist.len, 15);
+	for (y->nl = NLIT; y->nl > 257 && !y->lit.len[y->nl-1]; y->nl--);
+	for (y->nd = NDIST; y->nd > 1 && !y->dist.len[y->nd-1]; y->nd--);
+	U8 all[NLIT + NDIST];
+	U32 na = y->nl + y->nd, cf[19] = {0};
+	__builtin_memcpy(all, y->lit.len, y->nl);
+	__builtin_memcpy(all + y->nl, y->dist.len, y->nd);
+	y->nr = 0;
+	for (U32 i = 0; i < na;) {
+		U8 l = all[i];
+		U32 r = 1;
+		while (i + r < na && all[i+r] == l)
+			r++;
+		if (!l && r >= 3) {
+			r = MIN(r, 138U);
+			y->rs[y->nr] = r >= 11 ? 18 : 17;
+			y->rx[y->nr++] = r - (r >= 11 ? 11 : 3);
+		} else if (l && r >= 4) {
+			r = MIN(r, 7U);
+			y->rs[y->nr] = l;
+			y->rx[y->nr++] = 0;
+			y->rs[y->nr] = 16;
+			y->rx[y->nr++] = r - 4;
+		} else {
+			r = 1;
+			y->rs[y->nr] = l;
+			y->rx[y->nr++] = 0;
+		}
+		i += r;
+	}
+	for (U32 k = 0; k < y->nr; k++)
+		cf[y->rs[k]] += 1;
+	/* NOTE: inflate rejects an incomplete code length code */
+	U32 m = 0;
+	for (U32 k = 0; k < 19; k++)
+		m += cf[k] != 0;
+	for (U32 k = 0; m < 2; k++)
+		if (!cf[k]) {
+			cf[k] = 1;
+			m++;
+		}
+	hufflens(cf, 19, y->cl.len, 7);
+	for (y->ncl = 19; y->ncl > 4 && !y->cl.len[clorder[y->ncl-1]]; y->ncl--);
+	huffcodes(&y->lit, NLIT);
+	huffcodes(&y->dist, NDIST);
+	huffcodes(&y->cl, 19);
+	U64 bits = 3 + 5 + 5 + 4 + 3*y->ncl;
+	for (U32 k = 0; k < y->nr; k++)
+		bits += y->cl.len[y->rs[k]] + (y->rs[k] == 16 ? 2 : y->rs[k] == 17 ? 3 : y->rs[k] == 18 ? 7 : 0);
+	return bits;
+}
+
+static void putdynamic(Bits *b, Dynamic *y)
+{
+	putbits(b, y->nl - 257, 5);
+	putbits(b, y->nd - 1, 5);
+	putbits(b, y->ncl - 4, 4);
+	for (U32 k = 0; k < y->ncl; k++)
+		putbits(b, y->cl.len[clorder[k]], 3);
+	for (U32 k = 0; k < y->nr; k++) {
+		U8 s = y->rs[k];
+		putbits(b, y->cl.code[s], y->cl.len[s]);
+		if (s >= 16)
+			putbits(b, y->rx[k], s == 16 ? 2 : s == 17 ? 3 : 7);
+	}
+}
+
+/* NOTE: s is the source of the block's tokens, for the stored fallback.
+ * Consecutive stored blocks are put as one, so data that doesn't compress
+ * pays the stored headers only once per 64K, as with level 0. */
+static void putblock(Bits *b, U32 *t, U64 nt, U8 *s, U64 n, U8 level, OK final)
+{
+	U32 lf[NLIT] = {0}, df[NDIST] = {0}, e, ne;
+	for (U64 k = 0; k < nt; k++) {
+		if (t[k] < 256) {
+			lf[t[k]] += 1;
+		} else {
+			lf[lencode(t[k] >> 16, &e, &ne)] += 1;
+			df[distcode(t[k] & 0xFFFF, &e, &ne)] += 1;
+		}
+	}
+	lf[256] = 1;
+	Huff fl, fd;
+	Dynamic y;
+	fixedhuff(&fl, &fd);
+	U64 fbits = 3 + blockbits(lf, df, fl.len, fd.len);
+	U64 dbits = level > 1 ? dynamic(&y, lf, df) + blockbits(lf, df, y.lit.len, y.dist.len) : MAXVAL(U64);
+	if (storedbits(n) <= MIN(fbits, dbits)) {
+		if (!b->ps)
+			b->ps = s;
+		b->pn += n;
+		if (final)
+			flushstored(b, 1);
+		return;
+	}
+	flushstored(b, 0);
+	Huff *lc = &fl, *dc = &fd;
+	putbits(b, final, 1);
+	if (dbits < fbits) {
+		putbits(b, 2, 2);
+		putdynamic(b, &y);
+		lc = &y.lit;
+		dc = &y.dist;
+	} else {
+		putbits(b, 1, 2);
+	}
+	for (U64 k = 0; k < nt; k++) {
+		if (t[k] < 256) {
+			putbits(b, lc->code[t[k]], lc->len[t[k]]);
+			continue;
+		}
+		U32 c = lencode(t[k] >> 16, &e, &ne);
+		putbits(b, lc->code[c], lc->len[c]);
+		putbits(b, e, ne);
+		c = distcode(t[k] & 0xFFFF, &e, &ne);
+		putbits(b, dc->code[c], dc->len[c]);
+		putbits(b, e, ne);
+	}
+	putbits(b, lc->code[256], lc->len[256]);
+}
+
+static U32 hash3(U8 *p)
+{
+	return ((p[0] | p[1]<<8 | p[2]<<16)*2654435761U) >> (32 - HASHBITS);
+}
+
+static U32 matchlen(U8 *a, U8 *b, U32 max)
+{
+	U32 l = 0;
+	for (; l + 8 <= max; l += 8) {
+		U64 x, y;
+		__builtin_memcpy(&x, a + l, 8);
+		__builtin_memcpy(&y, b + l, 8);
+		if (x != y)
+			return l + __builtin_ctzll(x ^ y)/8;
+	}
+	while (l < max && a[l] == b[l])
+		l++;
+	return l;
+}
+
+U64 deflatebound(U64 n)
+{
+	return n + 6*(n/65535 + n/BLOCKTOKENS + 3) + 16;
+}
+
+U64 deflate(U8 *d, U8 *s, U64 n, U8 level, OK last)
+{
+	Bits b = {d, 0, 0, 0, 0, 0};
+	if (!level) {
+		putstored(&b, s, n, last);
+		return b.n;
+	}
+	/* NOTE: head and prev keep positions + 1, zero is the end of a chain */
+	U32 head[1 << HASHBITS] = {0}, prev[WINDOW], t[BLOCKTOKENS];
+	U32 chain = level > 1 ? 1U << (MIN(level, 9) - 2) : 0;
+	U64 nt = 0, bs = 0;
+	for (U64 i = 0; i < n;) {
+		U32 max = MIN(n - i, (U64)MAXMATCH), len = 0, dist = 0;
+		if (level == 1 && i && max >= MINMATCH) {
+			len = matchlen(s + i, s + i - 1, max);
+			dist = 1;
+		} else if (level > 1 && max >= MINMATCH) {
+			U32 p = head[hash3(s + i)];
+			for (U32 c = 0; p && c < chain && i - (p - 1) <= WINDOW; c++) {
+				U64 q = p - 1;
+				if (s[q + len] == s[i + len]) {
+					U32 l = matchlen(s + q, s + i, max);
+					if (l > len) {
+						len = l;
+						dist = i - q;
+						if (len == max)
+							break;
+					}
+				}
+				U32 np = prev[q & (WINDOW - 1)];
+				if (np >= p)
+					break;
+				p = np;
+			}
+		}
+		if (len < MINMATCH)
+			len = 1;
+		if (level > 1)
+			for (U64 k = i; k < i + len && k + MINMATCH <= n; k++) {
+				U32 h = hash3(s + k);
+				prev[k & (WINDOW - 1)] = head[h];
+				head[h] = k + 1;
+			}
+		t[nt++] = len > 1 ? len<<16 | dist : s[i];
+		i += len;
+		if (nt == BLOCKTOKENS) {
+			putblock(&b, t, nt, s + bs, i - bs, level, last && i == n);
+			nt = 0;
+			bs = i;
+		}
+	}
+	/* NOTE: a full block that ended the input was already the final one */
+	if (nt || !n)
+		putblock(&b, t, nt, s + bs, n - bs, level, last);
+	/* NOTE: a stored block ends on a byte boundary already */
+	if (!last && !b.ps)
+		putstored(&b, s + n, 0, 0);
+	flushstored(&b, 0);
+	alignbits(&b);
+	return b.n;
+}
@@ -0,0 +1,18 @@
+/* NOTE: checksums start from crc32update(0, ...) and adler32update(1, ...),
+ * adler32combine gives the checksum of the concatenation, nb is the
+ * length of the second part */
+U32 crc32update(U32 crc, U8 *p, U64 n);
+U32 adler32update(U32 a, U8 *p, U64 n);
+U32 adler32combine(U32 a, U32 b, U64 nb);
+
+/* NOTE: raw deflate into d, which has to hold deflatebound(n) bytes,
+ * returns the compressed size. Level 0 only stores, 1 takes runs with the
+ * fixed codes, 2..9 search hash chains of growing depth and build codes
+ * per block. Blocks that don't beat stored are stored, and runs of them
+ * are merged, so data that doesn't compress comes out within a few bytes
+ * of level 0. Unless last is set the output ends with a non-final stored
+ * block instead of the final block, so independently compressed pieces
+ * can be concatenated into one stream. Nothing is allocated, so the
+ * pieces can go to parfor. */
+U64 deflatebound(U64 n);
+U64 deflate(U8 *d, U8 *s, U64 n, U8 level, OK last);
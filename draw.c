@@ -1,13 +1,12 @@
 #include "types.h"
 #include "math.h"
 #include "time.h"
+#include "alloc.h"
 #include "color.h"
 #include "image.h"
+#include "par.h"
 #include "draw.h"
 
-/* IDEA: introduce a separate "shadering" rendering step, that would handle
- * pixel-by-pixel-rendered objects in pararallel using multiple threads */
-
 /* NOTE: In raster graphics, there is an ambiguity in how integer coordinates relate
  * to pixel geometry. Does a point [(x, y)] specify the center of the pixel
  * at row [y] and column [x]? Or some of its corners?
@@ -35,16 +34,687 @@
  *
  * Currently code here uses top-left corner interpretation (because math is a bit easier this way). */
 
+/* NOTE: Damage is kept aside of the images and looked up by their pixel memory,
+ * so drawing into a subimage damages the right part of the tracked image.
+ * The rects get merged as they come in, so there are at most MAXDAMAGE of them:
+ * uploading a few thousand extra pixels is cheaper than another request. */
+#define MAXTRACKED 4
+#define MAXDAMAGE 16
+#define DAMAGESLACK (64*64)
+
+typedef struct {
+	Color *p;
+	U16   w, h, s;
+	U32   nr;
+	Rect  r[MAXDAMAGE];
+} Damage;
+
+static struct {
+	U32    lock;
+	U32    n;
+	Damage d[MAXTRACKED];
+} damages;
+
+static void damagelock(void)
+{
+	while (__atomic_exchange_n(&damages.lock, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void damageunlock(void)
+{
+	__atomic_store_n(&damages.lock, 0, __ATOMIC_RELEASE);
+}
+
+static I64 rectarea(Rect r)
+{
+	return (I64)(r.x1 - r.x0)*(r.y1 - r.y0);
+}
+
+static Rect rectunion(Rect a, Rect b)
+{
+	return (Rect){MIN(a.x0, b.x0), MIN(a.y0, b.y0), MAX(a.x1, b.x1), MAX(a.y1, b.y1)};
+}
+
+static void mergedamage(Damage *d, Rect r)
+{
+	I64 best = -1, cost = 0;
+	for (U32 k = 0; k < d->nr; k++) {
+		I64 c = rectarea(rectunion(d->r[k], r)) - rectarea(d->r[k]) - rectarea(r);
+		if (best < 0 || c < cost)
+			best = k, cost = c;
+	}
+	if (best >= 0 && (cost <= DAMAGESLACK || d->nr == MAXDAMAGE))
+		d->r[best] = rectunion(d->r[best], r);
+	else
+		d->r[d->nr++] = r;
+}
+
+void trackdamage(Image *i, OK on)
+{
+	damagelock();
+	U32 k = 0;
+	while (k < damages.n && damages.d[k].p != i->p)
+		k++;
+	if (on && k == damages.n && k < MAXTRACKED) {
+		damages.d[k] = (Damage){i->p, i->w, i->h, i->s, 0, {{0}}};
+		damages.n += 1;
+	} else if (!on && k < damages.n) {
+		damages.d[k] = damages.d[damages.n - 1];
+		damages.n -= 1;
+	}
+	damageunlock();
+}
+
+void adddamage(Image *i, I64 x0, I64 y0, I64 x1, I64 y1)
+{
+	if (!__atomic_load_n(&damages.n, __ATOMIC_RELAXED))
+		return;
+	x0 = CLIPX(i, x0), x1 = CLIPX(i, x1);
+	y0 = CLIPY(i, y0), y1 = CLIPY(i, y1);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+	damagelock();
+	for (U32 k = 0; k < damages.n; k++) {
+		Damage *d = &damages.d[k];
+		if (i->p < d->p || i->p >= d->p + (U64)d->s*d->h)
+			continue;
+		U64 o = i->p - d->p;
+		I64 ox = o%d->s, oy = o/d->s;
+		mergedamage(d, (Rect){ox + x0, oy + y0, ox + x1, oy + y1});
+		break;
+	}
+	damageunlock();
+}
+
+I64 drawdamage(Image *i, Rect *r, I64 n)
+{
+	I64 m = 0;
+	damagelock();
+	for (U32 k = 0; k < damages.n; k++) {
+		Damage *d = &damages.d[k];
+		if (d->p != i->p)
+			continue;
+		for (U32 j = 0; j < d->nr; j++) {
+			if (m < n)
+				r[m++] = d->r[j];
+			else if (m)
+				r[m-1] = rectunion(r[m-1], d->r[j]);
+		}
+		d->nr = 0;
+	}
+	damageunlock();
+	return m;
+}
+
+/* NOTE: When drawing is deferred, primitives are not rasterized right away,
+ * instead they are appended to a command list. On sync the list is binned
+ * into screen tiles and every tile is rasterized independently (possibly
+ * on a separate thread) by replaying the commands that touch it, in the
+ * order they were submitted. Since every primitive is clipped to the tile
+ * and the rasterizers only depend on coordinate differences, the result
+ * is exactly the same as drawing everything directly.
+ *
+ * The tile is a subimage of the target, so the commands are translated
+ * into tile space on replay (coordinates that don't fit into I16 after the
+ * translation are saturated, which matters only for absurdly huge shapes). */
+
+#define TILEW 128
+#define TILEH 64
+
+typedef enum {
+	CmdClear,
+	CmdTriangle,
+	CmdSmoothTriangle,
+	CmdRing,
+	CmdCircle,
+	CmdSmoothCircle,
+	CmdSmoothDot,
+	CmdBezier,
+	CmdRect,
+	CmdLine,
+	CmdThickLine,
+	CmdPixel,
+} Cmdtype;
+
+/* NOTE: mode is the one of the image the command was recorded for */
+typedef struct {
+	U8    type, w;
+	I16   v[6];
+	Color c;
+	U8    mode;
+} Cmd;
+
+/* NOTE: number of (x, y) pairs in Cmd.v, the rest (if any) are sizes */
+static const U8 cmdpoints[] = {
+	[CmdClear] = 0,
+	[CmdTriangle] = 3,
+	[CmdSmoothTriangle] = 3,
+	[CmdRing] = 1,
+	[CmdCircle] = 1,
+	[CmdSmoothCircle] = 1,
+	[CmdSmoothDot] = 1,
+	[CmdBezier] = 3,
+	[CmdRect] = 1,
+	[CmdLine] = 2,
+	[CmdThickLine] = 2,
+	[CmdPixel] = 1,
+};
+
+typedef struct {
+	Image *target;
+	Cmd   *cmds;
+	U32   ncmd, cmdcap;
+	U32   *bins, bincap;
+	U32   *binstart, ntiles;
+	U32   ntx, nty;
+	OK    syncing;
+	OK    counted; /* NOTE: the damage of what gets drawn is already in */
+} Deferred;
+
+static Deferred defdraw;
+
+/* NOTE: a copy of the target's Image struct (say, with another mode for
+ * a single call) draws into the same pixels, so it is deferred as well.
+ * The tiles being replayed never are, even if one covers the whole target. */
+static OK deferred(Image *i)
+{
+	Image *t = defdraw.target;
+	if (!t || defdraw.syncing)
+		return 0;
+	return t->p == i->p && t->w == i->w && t->h == i->h && t->s == i->s;
+}
+
+static void cmdbounds(Cmd *c, I64 *x0, I64 *y0, I64 *x1, I64 *y1);
+
+static OK record(Image *i, Cmd c)
+{
+	Deferred *d = &defdraw;
+	/* NOTE: replayed commands were already counted when recorded */
+	if (!d->syncing && !d->counted && __atomic_load_n(&damages.n, __ATOMIC_RELAXED)) {
+		I64 x0, y0, x1, y1;
+		cmdbounds(&c, &x0, &y0, &x1, &y1);
+		adddamage(i, x0, y0, x1, y1);
+	}
+	if (!deferred(i))
+		return 0;
+	if (d->ncmd == d->cmdcap) {
+		d->cmdcap = d->cmdcap*2 + 256;
+		d->cmds = memrealloc(d->cmds, d->cmdcap*sizeof(d->cmds[0]));
+	}
+	d->cmds[d->ncmd] = c;
+	d->ncmd += 1;
+	return 1;
+}
+
+/* NOTE: bounding box is half-open and conservative, it only needs to
+ * cover every pixel the primitive could possibly touch */
+static void cmdbounds(Cmd *c, I64 *x0, I64 *y0, I64 *x1, I64 *y1)
+{
+	I16 *v = c->v;
+	switch (c->type) {
+	case CmdClear:
+	default:
+		*x0 = MINVAL(I16), *x1 = MAXVAL(I16);
+		*y0 = MINVAL(I16), *y1 = MAXVAL(I16);
+		break;
+	case CmdTriangle:
+	case CmdSmoothTriangle:
+	case CmdBezier:
+		*x0 = MIN3(v[0], v[2], v[4]), *x1 = MAX3(v[0], v[2], v[4]) + 1;
+		*y0 = MIN3(v[1], v[3], v[5]), *y1 = MAX3(v[1], v[3], v[5]) + 1;
+		break;
+	case CmdRing:
+	case CmdCircle:
+	case CmdSmoothCircle:
+		*x0 = v[0] - v[2], *x1 = v[0] + v[2] + 1;
+		*y0 = v[1] - v[2], *y1 = v[1] + v[2] + 1;
+		break;
+	case CmdSmoothDot:
+		*x0 = v[0] - v[2], *x1 = v[0] + v[2] + 2;
+		*y0 = v[1] - v[2], *y1 = v[1] + v[2] + 2;
+		break;
+	case CmdRect:
+		*x0 = MIN(v[0], v[0] + v[2]), *x1 = MAX(v[0], v[0] + v[2]);
+		*y0 = MIN(v[1], v[1] + v[3]), *y1 = MAX(v[1], v[1] + v[3]);
+		break;
+	case CmdLine:
+		*x0 = MIN(v[0], v[2]), *x1 = MAX(v[0], v[2]) + 1;
+		*y0 = MIN(v[1], v[3]), *y1 = MAX(v[1], v[3]) + 1;
+		break;
+	case CmdThickLine:
+		*x0 = MIN(v[0], v[2]) - c->w - 1, *x1 = MAX(v[0], v[2]) + c->w + 2;
+		*y0 = MIN(v[1], v[3]) - c->w - 1, *y1 = MAX(v[1], v[3]) + c->w + 2;
+		break;
+	case CmdPixel:
+		*x0 = v[0], *x1 = v[0] + 1;
+		*y0 = v[1], *y1 = v[1] + 1;
+		break;
+	}
+}
+
+static void smoothdot(Image *i, I16 x, I16 y, I16 fx, I16 fy, I16 r, Color c);
+
+static void replay(Image *i, Cmd c, I64 ox, I64 oy)
+{
+	for (U8 k = 0; k < cmdpoints[c.type]; k++) {
+		c.v[2*k]   = CLAMP(c.v[2*k] - ox,   MINVAL(I16), MAXVAL(I16));
+		c.v[2*k+1] = CLAMP(c.v[2*k+1] - oy, MINVAL(I16), MAXVAL(I16));
+	}
+	I16 *v = c.v;
+	switch (c.type) {
+	case CmdClear:          drawclear(i, c.c); break;
+	case CmdTriangle:       drawtriangle(i, v[0], v[1], v[2], v[3], v[4], v[5], c.c); break;
+	case CmdSmoothTriangle: drawsmoothtriangle(i, v[0], v[1], v[2], v[3], v[4], v[5], c.c); break;
+	case CmdRing:           drawring(i, v[0], v[1], v[2], c.c); break;
+	case CmdCircle:         drawcircle(i, v[0], v[1], v[2], c.c); break;
+	case CmdSmoothCircle:   drawsmoothcircle(i, v[0], v[1], v[2], c.c); break;
+	case CmdSmoothDot:      smoothdot(i, v[0], v[1], v[3], v[4], v[2], c.c); break;
+	case CmdBezier:         drawbezier(i, v[0], v[1], v[2], v[3], v[4], v[5], c.c); break;
+	case CmdRect:           drawrect(i, v[0], v[1], v[2], v[3], c.c); break;
+	case CmdLine:           drawline(i, v[0], v[1], v[2], v[3], c.c); break;
+	case CmdThickLine:      drawthickline(i, v[0], v[1], v[2], v[3], c.w, c.c); break;
+	case CmdPixel:          drawpixel(i, v[0], v[1], c.c); break;
+	}
+}
+
+static OK cmdtiles(Deferred *d, Cmd *c, I64 *tx0, I64 *ty0, I64 *tx1, I64 *ty1)
+{
+	Image *i = d->target;
+	I64 x0, y0, x1, y1;
+	cmdbounds(c, &x0, &y0, &x1, &y1);
+	x0 = CLIPX(i, x0), x1 = CLIPX(i, x1);
+	y0 = CLIPY(i, y0), y1 = CLIPY(i, y1);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+	*tx0 = x0/TILEW, *tx1 = (x1 - 1)/TILEW + 1;
+	*ty0 = y0/TILEH, *ty1 = (y1 - 1)/TILEH + 1;
+	return 1;
+}
+
+static void bin(Deferred *d)
+{
+	d->ntx = divceil(d->target->w, TILEW);
+	d->nty = divceil(d->target->h, TILEH);
+	d->ntiles = d->ntx*d->nty;
+	d->binstart = memrealloc(d->binstart, (d->ntiles + 1)*sizeof(d->binstart[0]));
+	for (U32 t = 0; t <= d->ntiles; t++)
+		d->binstart[t] = 0;
+	/* NOTE: first count the commands per tile, then turn the counts
+	 * into offsets and fill the bins in submission order */
+	U32 total = 0;
+	for (U32 k = 0; k < d->ncmd; k++) {
+		I64 tx0, ty0, tx1, ty1;
+		if (!cmdtiles(d, &d->cmds[k], &tx0, &ty0, &tx1, &ty1))
+			continue;
+		for (I64 ty = ty0; ty < ty1; ty++)
+		for (I64 tx = tx0; tx < tx1; tx++)
+			d->binstart[ty*d->ntx + tx + 1] += 1;
+		total += (tx1 - tx0)*(ty1 - ty0);
+	}
+	for (U32 t = 0; t < d->ntiles; t++)
+		d->binstart[t+1] += d->binstart[t];
+	if (total > d->bincap) {
+		d->bincap = total;
+		memfree(d->bins);
+		d->bins = memalloc(d->bincap*sizeof(d->bins[0]));
+	}
+	for (U32 k = 0; k < d->ncmd; k++) {
+		I64 tx0, ty0, tx1, ty1;
+		if (!cmdtiles(d, &d->cmds[k], &tx0, &ty0, &tx1, &ty1))
+			continue;
+		for (I64 ty = ty0; ty < ty1; ty++)
+		for (I64 tx = tx0; tx < tx1; tx++)
+			d->bins[d->binstart[ty*d->ntx + tx]++] = k;
+	}
+	/* NOTE: the fill pass shifted every offset to the start of the next bin */
+	for (U32 t = d->ntiles; t > 0; t--)
+		d->binstart[t] = d->binstart[t-1];
+	d->binstart[0] = 0;
+}
+
+static void drawtile(void *ctx, U64 t)
+{
+	Deferred *d = ctx;
+	if (d->binstart[t] == d->binstart[t+1])
+		return;
+	U16 x = t%d->ntx*TILEW, y = t/d->ntx*TILEH;
+	Image tile = subimage(*d->target, x, y, TILEW, TILEH);
+	for (U32 k = d->binstart[t]; k < d->binstart[t+1]; k++) {
+		Cmd *c = &d->cmds[d->bins[k]];
+		tile.mode = c->mode;
+		replay(&tile, *c, x, y);
+	}
+}
+
+void drawsync(void)
+{
+	Deferred *d = &defdraw;
+	if (!d->target || !d->ncmd)
+		return;
+	bin(d);
+	/* NOTE: replay goes through the public draw functions, but tiles
+	 * are separate images, so nothing gets recorded again */
+	d->syncing = 1;
+	parfor(d->ntiles, drawtile, d);
+	d->syncing = 0;
+	d->ncmd = 0;
+}
+
+void drawdefer(Image *i)
+{
+	drawsync();
+	defdraw.target = i;
+}
+
 void drawclear(Image *i, Color c)
 {
-	for (I64 x = 0; x < i->w; x++)
+	if (record(i, (Cmd){CmdClear, 0, {0}, c, i->mode}))
+		return;
+	/* NOTE: no blending here */
+	if (i->mode == ImagePremul)
+		c = premul(c);
+	if (i->s == i->w) {
+		fillspan(i->p, c, (U64)i->w*i->h);
+		return;
+	}
 	for (I64 y = 0; y < i->h; y++)
-		PIXEL(i, x, y) = c; /* NOTE: no blending here */
+		fillspan(&PIXEL(i, 0, y), c, i->w);
+}
+
+/* NOTE: all the spans are half-open: [x0, x1) */
+static void span(Image *i, I64 y, I64 x0, I64 x1, Color c)
+{
+	if (x0 >= x1)
+		return;
+	switch (i->mode) {
+	case ImagePremul:
+		pmblendfill(&PIXEL(i, x0, y), premul(c), x1 - x0);
+		break;
+	case ImageSRGB:
+		srgbblendfill(&PIXEL(i, x0, y), c, x1 - x0);
+		break;
+	default:
+		blendfill(&PIXEL(i, x0, y), c, x1 - x0);
+	}
+}
+
+/* NOTE: blends a run of per-pixel alphas (0 means "skip") */
+static void cover(Image *i, I64 y, I64 x0, U8 *a, I64 n, Color c)
+{
+	switch (i->mode) {
+	case ImagePremul:
+		pmblendspan(&PIXEL(i, x0, y), SETA(c, 255), a, n);
+		break;
+	case ImageSRGB:
+		srgbblendspan(&PIXEL(i, x0, y), SETA(c, 255), a, n);
+		break;
+	default:
+		blendspan(&PIXEL(i, x0, y), SETA(c, 255), a, n);
+	}
+}
+
+/* NOTE: for the loops that blend pixel by pixel */
+typedef Color Blendfn(Color b, Color t);
+
+static Color blendcolor(Image *i, Color c)
+{
+	return i->mode == ImagePremul ? premul(c) : c;
+}
+
+static Blendfn *blender(Image *i, Color *c)
+{
+	*c = blendcolor(i, *c);
+	switch (i->mode) {
+	case ImagePremul:
+		return pmblend;
+	case ImageSRGB:
+		srgbinit();
+		return srgbblend;
+	default:
+		return blend;
+	}
+}
+
+static Cmd primcmd(Image *i, Prims *p, Cmdtype type, I64 k)
+{
+	return (Cmd){type, 0, {p->x[k], p->y[k], p->u[k], p->v ? p->v[k] : 0}, p->c ? p->c[k] : p->color, i->mode};
+}
+
+static void blendline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, Blendfn *bl, Color c);
+
+/* NOTE: Batches bigger than PRIMSDIRECT, or ones for an image that is already
+ * deferred, are recorded and binned like deferred drawing, so every tile (a row
+ * band piece) gets drawn in one go, in the submission order. Smaller ones are
+ * drawn right away, since binning and waking the workers would cost more than
+ * drawing them. Either way the damage of the whole batch is added at once. */
+#define PRIMSDIRECT 64
+
+static void drawprims(Image *i, Prims *p, Cmdtype type)
+{
+	Deferred *d = &defdraw;
+	if (p->n <= 0 || (!p->v && (type == CmdRect || type == CmdLine)))
+		return;
+	if (!d->syncing && !d->counted && __atomic_load_n(&damages.n, __ATOMIC_RELAXED)) {
+		I64 x0 = MAXVAL(I64), y0 = MAXVAL(I64), x1 = MINVAL(I64), y1 = MINVAL(I64);
+		for (I64 k = 0; k < p->n; k++) {
+			Cmd c = primcmd(i, p, type, k);
+			I64 cx0, cy0, cx1, cy1;
+			cmdbounds(&c, &cx0, &cy0, &cx1, &cy1);
+			x0 = MIN(x0, cx0), x1 = MAX(x1, cx1);
+			y0 = MIN(y0, cy0), y1 = MAX(y1, cy1);
+		}
+		adddamage(i, x0, y0, x1, y1);
+	}
+	Image *prev = d->target;
+	OK def = deferred(i);
+	if (def || p->n > PRIMSDIRECT) {
+		if (!def)
+			drawdefer(i);
+		if (d->ncmd + p->n > d->cmdcap) {
+			d->cmdcap = MAX(d->cmdcap*2 + 256, d->ncmd + p->n);
+			d->cmds = memrealloc(d->cmds, d->cmdcap*sizeof(d->cmds[0]));
+		}
+		for (I64 k = 0; k < p->n; k++)
+			d->cmds[d->ncmd++] = primcmd(i, p, type, k);
+		if (!def)
+			drawdefer(prev);
+		return;
+	}
+	Color c0 = p->color;
+	Blendfn *bl = blender(i, &c0);
+	d->counted = 1;
+	for (I64 k = 0; k < p->n; k++) {
+		Cmd c = primcmd(i, p, type, k);
+		if (type != CmdLine)
+			replay(i, c, 0, 0);
+		else
+			blendline(i, c.v[0], c.v[1], c.v[2], c.v[3], bl, p->c ? blendcolor(i, c.c) : c0);
+	}
+	d->counted = 0;
+}
+
+void drawcircles(Image *i, Prims *p)
+{
+	drawprims(i, p, CmdCircle);
+}
+
+void drawsmoothcircles(Image *i, Prims *p)
+{
+	drawprims(i, p, CmdSmoothCircle);
+}
+
+void drawrects(Image *i, Prims *p)
+{
+	drawprims(i, p, CmdRect);
+}
+
+void drawlines(Image *i, Prims *p)
+{
+	drawprims(i, p, CmdLine);
+}
+
+/* NOTE: For any vector (x, y) (y, -x) will be it`s 90-degree clockwise rotation.
+ * Using this insight we can easily check if a point p=(xp, yp) is to the left or
+ * to the right of a line p1=(x1, y1) -> p2=(x2, y2) by calculating the dot product
+ * between (p - p1) and the right normal to the (p2 - p1): it`s sign will give us
+ * orientation (-1 (to the left), 0 (on the line) or 1 (to the right)) and it`s
+ * magnitude will be equal to the area of the parallelogram formed by
+ * (p2 - p1) and (p - p1). A pixel is inside a triangle when all three of these
+ * edge functions are non-negative at its center. Since they are linear, checking
+ * the corners of an 8x8 block is enough to tell that the whole block is inside
+ * or outside, so only the blocks crossed by the edges are tested per pixel. */
+#define BLOCK 8
+
+typedef struct {
+	I64 e, dx, dy;
+} Edge;
+
+/* NOTE: value at the center of the pixel (x, y) and steps per pixel */
+static Edge edge(I64 xa, I64 ya, I64 xb, I64 yb, I64 x, I64 y)
+{
+	Edge e = {
+		(y*FIX + FIX/2 - ya)*(xb - xa) - (x*FIX + FIX/2 - xa)*(yb - ya),
+		-(yb - ya)*FIX,
+		(xb - xa)*FIX,
+	};
+	/* NOTE: top-left rule, pixels exactly on an edge belong to the triangle
+	 * only if that is a left or a top edge, so adjacent ones never overlap */
+	if (e.dx < 0 || (e.dx == 0 && e.dy <= 0))
+		e.e -= 1;
+	return e;
+}
+
+/* NOTE: spans of the pixels of [xmin, xmax) x [ymin, ymax) where all three
+ * edges are non-negative, the edge values are the ones at (xmin, ymin) */
+static void edgespans(Edge *e, I64 xmin, I64 xmax, I64 ymin, I64 ymax, Spanfn *f, void *ctx)
+{
+	for (I64 by = ymin; by < ymax; by += BLOCK) {
+		I64 bh = MIN(BLOCK, ymax - by);
+		I64 l[BLOCK], r[BLOCK];
+		for (I64 k = 0; k < bh; k++) {
+			l[k] = xmax;
+			r[k] = xmin;
+		}
+		/* NOTE: blocks left of where the edges growing to the right turn
+		 * non-negative are outside, so they are skipped with a division */
+		I64 bx = xmin, il = xmax, ir = xmin;
+		for (I64 j = 0; j < 3; j++) {
+			I64 n = -e[j].e - (by - ymin)*e[j].dy - MAX((bh - 1)*e[j].dy, 0) - (BLOCK - 1)*e[j].dx;
+			if (e[j].dx > 0 && n > 0)
+				bx = MAX(bx, xmin + BLOCK*(I64)divceil(n, BLOCK*e[j].dx));
+		}
+		for (; bx < xmax; bx += BLOCK) {
+			I64 bw = MIN(BLOCK, xmax - bx);
+			I64 v[3];
+			OK in = 1, out = 0, past = 0;
+			for (I64 j = 0; j < 3; j++) {
+				v[j] = e[j].e + (bx - xmin)*e[j].dx + (by - ymin)*e[j].dy;
+				I64 sx = (bw - 1)*e[j].dx, sy = (bh - 1)*e[j].dy;
+				if (v[j] + MAX(sx, 0) + MAX(sy, 0) < 0) {
+					out = 1;
+					past |= e[j].dx <= 0;
+				}
+				if (v[j] + MIN(sx, 0) + MIN(sy, 0) < 0)
+					in = 0;
+			}
+			/* NOTE: an edge that doesn't grow to the right stays negative
+			 * for the rest of the block row */
+			if (past)
+				break;
+			if (out)
+				continue;
+			/* NOTE: the inside blocks of a row are contiguous, and they last
+			 * until an edge falling to the right gets negative in a corner */
+			if (in) {
+				I64 nb = (xmax - bx - 1)/BLOCK;
+				for (I64 j = 0; j < 3; j++) {
+					I64 m = v[j] + (BLOCK - 1)*e[j].dx + MIN((bh - 1)*e[j].dy, 0);
+					if (e[j].dx < 0)
+						nb = MIN(nb, m/(-BLOCK*e[j].dx));
+				}
+				il = MIN(il, bx);
+				bx += nb*BLOCK;
+				ir = MIN(bx + BLOCK, xmax);
+				continue;
+			}
+			/* NOTE: the triangle is convex, so covered pixels of a row are contiguous */
+			for (I64 k = 0; k < bh; k++) {
+				I64 a = v[0] + k*e[0].dy, b = v[1] + k*e[1].dy, c = v[2] + k*e[2].dy;
+				for (I64 x = bx; x < bx + bw; x++) {
+					if ((a | b | c) >= 0) {
+						l[k] = MIN(l[k], x);
+						r[k] = MAX(r[k], x + 1);
+					}
+					a += e[0].dx;
+					b += e[1].dx;
+					c += e[2].dx;
+				}
+			}
+		}
+		for (I64 k = 0; k < bh; k++) {
+			l[k] = MIN(l[k], il);
+			r[k] = MAX(r[k], ir);
+			if (l[k] < r[k])
+				f(ctx, by + k, l[k], r[k]);
+		}
+	}
+}
+
+void trianglespans(Image *i, I64 x1, I64 y1, I64 x2, I64 y2, I64 x3, I64 y3, Spanfn *f, void *ctx)
+{
+	I64 cross = (y3 - y1)*(x2 - x1) - (x3 - x1)*(y2 - y1);
+	if (!cross)
+		return;
+	if (cross < 0) {
+		SWAP(x2, x3);
+		SWAP(y2, y3);
+	}
+	I64 xmin = CLIPX(i, (MIN3(x1, x2, x3) - FIX/2 + FIX-1) >> FIXBITS);
+	I64 xmax = CLIPX(i, ((MAX3(x1, x2, x3) - FIX/2) >> FIXBITS) + 1);
+	I64 ymin = CLIPY(i, (MIN3(y1, y2, y3) - FIX/2 + FIX-1) >> FIXBITS);
+	I64 ymax = CLIPY(i, ((MAX3(y1, y2, y3) - FIX/2) >> FIXBITS) + 1);
+	Edge e[3] = {
+		edge(x1, y1, x2, y2, xmin, ymin),
+		edge(x2, y2, x3, y3, xmin, ymin),
+		edge(x3, y3, x1, y1, xmin, ymin),
+	};
+	edgespans(e, xmin, xmax, ymin, ymax, f, ctx);
+}
+
+typedef struct {
+	Image *i;
+	Color c;
+} Fill;
+
+static void fillspanfn(void *ctx, I64 y, I64 x0, I64 x1)
+{
+	Fill *f = ctx;
+	span(f->i, y, x0, x1, f->c);
+}
+
+/* NOTE: drawtriangle covers every row from the top vertex to the bottom one,
+ * each from one edge to the other inclusive, with the edge x rounded from the
+ * row's y (half away from zero). With y going down from a the sign of the
+ * rounded offset is the one of xb - xa, so the rounding is a half-space test
+ * as well: for D = yb - ya > 0 and E(x, y) = 2D(x - xa) - 2(y - ya)(xb - xa) + D
+ * x is right of the edge when E > 0 (E >= 0 if xb < xa), and left of it when
+ * E <= 2D (E < 2D if xb < xa). */
+static Edge roundedge(I64 xa, I64 ya, I64 xb, I64 yb, OK left, I64 x, I64 y)
+{
+	I64 d = yb - ya, dx = xb - xa;
+	Edge e = {2*d*(x - xa) - 2*(y - ya)*dx + d, 2*d, -2*dx};
+	if (!left)
+		e = (Edge){2*d - e.e, -e.dx, -e.dy};
+	if ((dx >= 0) == left)
+		e.e -= 1;
+	return e;
 }
 
-/* TODO: an aa version that uses covered pixel area as opacity */
 void drawtriangle(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c)
 {
+	if (record(i, (Cmd){CmdTriangle, 0, {x1, y1, x2, y2, x3, y3}, c, i->mode}))
+		return;
 	if (y3 < y1) {
 		SWAP(x1, x3);
 		SWAP(y1, y3);
@@ -56,101 +726,299 @@ void drawtriangle(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Colo
 		SWAP(x1, x2);
 		SWAP(y1, y2);
 	}
+	I64 xmin = CLIPX(i, MIN3(x1, x2, x3)), xmax = CLIPX(i, MAX3(x1, x2, x3)+1);
 	if (y1 == y3) {
-		for (I64 x = CLIPX(i, MIN3(x1, x2, x3)); x < CLIPX(i, MAX3(x1, x2, x3)+1); x++)
-			PIXEL(i, x, y1) = blend(PIXEL(i, x, y1), c);
-	} else {
-		I64 ymid = y2;
-		if (y2 == y3)
-			ymid += 1;
-		for (I64 y = CLIPY(i, y1); y < CLIPY(i, ymid); y++) {
-			I64 x12 = x1 + divround((y - y1)*(x2 - x1), (y2 - y1));
-			I64 x13 = x1 + divround((y - y1)*(x3 - x1), (y3 - y1));
-			for (I64 x = CLIPX(i, MIN(x12, x13)); x < CLIPX(i, MAX(x12, x13)+1); x++)
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
-		}
-		for (I64 y = CLIPY(i, ymid); y < CLIPY(i, y3 + 1); y++) {
-			I64 x23 = x2 + divround((y - y2)*(x3 - x2), (y3 - y2));
-			I64 x13 = x1 + divround((y - y1)*(x3 - x1), (y3 - y1));
-			for (I64 x = CLIPX(i, MIN(x13, x23)); x < CLIPX(i, MAX(x13, x23)+1); x++)
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+		if (CHECKY(i, y1))
+			span(i, y1, xmin, xmax, c);
+		return;
+	}
+	/* NOTE: the long edge 1-3 is on the left when 2 is right of it, the rows
+	 * above y2 are closed by the edge 1-2, the rest by 2-3 */
+	OK left = (I64)(x2 - x1)*(y3 - y1) - (I64)(x3 - x1)*(y2 - y1) >= 0;
+	I64 ymid = y2 + (y2 == y3), ya = CLIPY(i, y1), yb = CLIPY(i, ymid), yc = CLIPY(i, y3 + 1);
+	if (ya < yb) {
+		Edge e[3] = {roundedge(x1, y1, x3, y3, left, xmin, ya), roundedge(x1, y1, x2, y2, !left, xmin, ya), {0}};
+		edgespans(e, xmin, xmax, ya, yb, fillspanfn, &(Fill){i, c});
+	}
+	if (yb < yc) {
+		Edge e[3] = {roundedge(x1, y1, x3, y3, left, xmin, yb), roundedge(x2, y2, x3, y3, !left, xmin, yb), {0}};
+		edgespans(e, xmin, xmax, yb, yc, fillspanfn, &(Fill){i, c});
+	}
+}
+
+/* NOTE: Since vertices are integer (pixel corners), a triangle never bends inside
+ * the scanline strip [y, y+1], so within it both the left and the right boundaries
+ * are straight segments going from x(y) to x(y+1). For a segment s the fraction
+ * of the pixel column [x, x+1] that lies to the left of it is
+ *
+ *     F(s, x) = integral(clamp(s(t) - x, 0, 1), t=0..1)
+ *
+ * and the pixel coverage is simply F(right, x) - F(left, x). To the left of a segment
+ * F is 1, to the right of it F is 0, so only pixels that the edges pass through need
+ * to be computed, and everything between the two edges is fully covered.
+ *
+ * For a linear s(t) from a to b the integral is (G(b - x) - G(a - x))/(b - a), where
+ * G is the antiderivative of clamp(u, 0, 1): 0, u^2/2 and u - 1/2 on the three pieces. */
+static I64 coverg(I64 u)
+{
+	if (u <= 0)
+		return 0;
+	if (u <= FIX)
+		return u*u/2;
+	return FIX*u - FIX*FIX/2;
+}
+
+static I64 coverf(I64 a, I64 b, I64 x)
+{
+	I64 u0 = a - x*FIX, u1 = b - x*FIX;
+	if (u0 == u1)
+		return CLAMP(u0, 0, FIX);
+	return divround(coverg(u1) - coverg(u0), u1 - u0);
+}
+
+static I64 edgex(I64 xa, I64 ya, I64 xb, I64 yb, I64 y)
+{
+	return xa*FIX + divround((y - ya)*(xb - xa)*FIX, yb - ya);
+}
+
+/* NOTE: blends analytic coverage for the pixels [x0, x1) of the strip */
+static void coverstrip(Image *i, I64 y, I64 x0, I64 x1, I64 la, I64 lb, I64 ra, I64 rb, Color c)
+{
+	U8 a[256];
+	x0 = CLIPX(i, x0), x1 = CLIPX(i, x1);
+	while (x0 < x1) {
+		I64 m = MIN(x1 - x0, (I64)sizeof(a));
+		for (I64 k = 0; k < m; k++) {
+			I64 cov = CLAMP(coverf(ra, rb, x0 + k) - coverf(la, lb, x0 + k), 0, FIX);
+			a[k] = (A(c)*cov + FIX/2)/FIX;
 		}
+		cover(i, y, x0, a, m, c);
+		x0 += m;
 	}
 }
 
-/* NOTE: For any vector (x, y) (y, -x) will be it`s 90-degree clockwise rotation.
- * Using this insight we can easily check if a point p=(xp, yp) is to the left or
- * to the right of a line p1=(x1, y1) -> p2=(x2, y2) by calculating the dot product
- * between (p - p1) and the right normal to the (p2 - p1): it`s sign will give us
- * orientation (-1 (to the left), 0 (on the line) or 1 (to the right)) and it`s
- * magnitude will be equal to the area of the parallelogram formed by
- * (p2 - p1) and (p - p1). This gives you a way of checking if a point is inside
- * a triangle and doing barycentric interpolation. */
 void drawsmoothtriangle(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c)
 {
-	const I64 n = 3;
-	I64 xmin = CLIPX(i, MIN3(x1, x2, x3)), xmax = CLIPX(i, MAX3(x1, x2, x3)+1);
-	I64 ymin = CLIPY(i, MIN3(y1, y2, y3)), ymax = CLIPY(i, MAX3(y1, y2, y3)+1);
-	/* NOTE: ensure clockwise winding */
-	if ((y3 - y1)*(x2 - x1) - (x3 - x1)*(y2 - y1) < 0) {
+	if (record(i, (Cmd){CmdSmoothTriangle, 0, {x1, y1, x2, y2, x3, y3}, c, i->mode}))
+		return;
+	if (y3 < y1) {
+		SWAP(x1, x3);
+		SWAP(y1, y3);
+	}
+	if (y3 < y2) {
 		SWAP(x2, x3);
 		SWAP(y2, y3);
+	} else if (y2 < y1) {
+		SWAP(x1, x2);
+		SWAP(y1, y2);
 	}
-	I64 o1 = n*((ymin - y1)*(x2 - x1) - (xmin - x1)*(y2 - y1));
-	I64 o2 = n*((ymin - y2)*(x3 - x2) - (xmin - x2)*(y3 - y2));
-	I64 o3 = n*((ymin - y3)*(x1 - x3) - (xmin - x3)*(y1 - y3));
-	for (I64 y = ymin; y < ymax; y++) {
-		for (I64 x = xmin; x < xmax; x++) {
-			I64 hits = 0;
-			for (I64 dx = 0; dx < n; dx++) {
-				for (I64 dy = 0; dy < n; dy++) {
-					hits += o1 >= 0 && o2 >= 0 && o3 >= 0;
-					o1 += x2 - x1, o2 += x3 - x2, o3 += x1 - x3;
-				}
-				o1 -= (x2 - x1)*n + (y2 - y1);
-				o2 -= (x3 - x2)*n + (y3 - y2);
-				o3 -= (x1 - x3)*n + (y1 - y3);
-			}
-			if (hits)
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), SETA(c, A(c)*hits/SQUARE(n)));
+	/* NOTE: the sign tells on which side of the long edge (1, 3) the vertex 2 is */
+	I64 cross = (x2 - x1)*(y3 - y1) - (x3 - x1)*(y2 - y1);
+	if (!cross)
+		return;
+	for (I64 y = CLIPY(i, y1); y < CLIPY(i, y3); y++) {
+		I64 la = edgex(x1, y1, x3, y3, y), lb = edgex(x1, y1, x3, y3, y + 1), ra, rb;
+		if (y + 1 <= y2)
+			ra = edgex(x1, y1, x2, y2, y), rb = edgex(x1, y1, x2, y2, y + 1);
+		else
+			ra = edgex(x2, y2, x3, y3, y), rb = edgex(x2, y2, x3, y3, y + 1);
+		if (cross < 0) {
+			SWAP(la, ra);
+			SWAP(lb, rb);
+		}
+		/* NOTE: pixel ranges touched by the left and right edges */
+		I64 l0 = MIN(la, lb) >> FIXBITS, l1 = (MAX(la, lb) + FIX-1) >> FIXBITS;
+		I64 r0 = MIN(ra, rb) >> FIXBITS, r1 = (MAX(ra, rb) + FIX-1) >> FIXBITS;
+		if (l1 < r0) {
+			coverstrip(i, y, l0, l1, la, lb, ra, rb, c);
+			span(i, y, CLIPX(i, l1), CLIPX(i, r0), c);
+			coverstrip(i, y, r0, r1, la, lb, ra, rb, c);
+		} else {
+			coverstrip(i, y, l0, r1, la, lb, ra, rb, c);
 		}
-		o1 += n*((y2 - y1)*(xmax - xmin) + (x2 - x1));
-		o2 += n*((y3 - y2)*(xmax - xmin) + (x3 - x2));
-		o3 += n*((y1 - y3)*(xmax - xmin) + (x1 - x3));
 	}
 }
 
 void drawcircle(Image *i, I16 xc, I16 yc, I16 r, Color c)
 {
-	for (I64 y = CLIPY(i, yc-r); y < CLIPY(i, yc+r+1); y++)
-	for (I64 x = CLIPX(i, xc-r); x < CLIPX(i, xc+r+1); x++)
-		if (SQUARE(x-xc) + SQUARE(y-yc) <= SQUARE(r))
-			PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+	if (record(i, (Cmd){CmdCircle, 0, {xc, yc, r}, c, i->mode}))
+		return;
+	/* NOTE: (x - xc)^2 <= r^2 - (y - yc)^2 <=> |x - xc| <= isqrt(r^2 - (y - yc)^2) */
+	for (I64 y = CLIPY(i, yc-r); y < CLIPY(i, yc+r+1); y++) {
+		I64 hw = isqrt(SQUARE(r) - SQUARE(y-yc));
+		span(i, y, CLIPX(i, xc-hw), CLIPX(i, xc+hw+1), c);
+	}
 }
 
-void drawsmoothcircle(Image *i, I16 xc, I16 yc, I16 r, Color c)
+/* NOTE: Smooth circles up to STAMPMAXR are blitted from cached coverage stamps.
+ * A stamp holds the number of the 3x3 supersamples inside the circle for every
+ * pixel of its (2r + 2)x(2r + 2) box, with the center at (r, r) shifted by
+ * (fx, fy)/STAMPQ of a pixel, so the offset 0 ones are exactly what the direct
+ * loop below computes. The stamps are built on first use and may be requested
+ * by several deferred tiles at once, hence the build state. */
+#define STAMPMAXR 16
+#define STAMPQBITS 2
+#define STAMPQ (1 << STAMPQBITS)
+#define STAMPW (2*STAMPMAXR + 2)
+
+enum {
+	StampEmpty,
+	StampBuilding,
+	StampReady,
+};
+
+typedef struct {
+	U32 state;
+	/* NOTE: [x0, x1) is the covered part of a row, [i0, i1) is the fully covered one */
+	U8  x0[STAMPW], x1[STAMPW];
+	U8  i0[STAMPW], i1[STAMPW];
+	U8  hits[STAMPW*STAMPW];
+} Stamp;
+
+static Stamp stamps[STAMPMAXR + 1][STAMPQ][STAMPQ];
+
+static void stampbuild(Stamp *s, I64 r, I64 fx, I64 fy)
 {
-	const I64 n = 3; /* NOTE: looks ok */
-	for (I64 y = CLIPY(i, yc-r); y < CLIPY(i, yc+r+1); y++)
-	for (I64 x = CLIPX(i, xc-r); x < CLIPX(i, xc+r+1); x++) {
-		/* NOTE: check if the point and it's neighbours are
-		 * definitely inside the circle */
-		I64 xo = iabs(x-xc), yo = iabs(y-yc);
-		if (xo < r*45/64 && yo < r*45/64) {
-			PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
-		} else {
-			I64 hits = 0;
+	const I64 n = 3, q = n*STAMPQ;
+	for (I64 y = 0; y < 2*r + 2; y++) {
+		U8 *h = &s->hits[y*STAMPW];
+		I64 yo = iabs((y - r)*q - fy*n);
+		s->x0[y] = s->x1[y] = s->i0[y] = s->i1[y] = 0;
+		for (I64 x = 0; x < 2*r + 2; x++) {
+			I64 xo = iabs((x - r)*q - fx*n);
+			h[x] = 0;
 			for (I64 dx = 0; dx < n; dx++)
 			for (I64 dy = 0; dy < n; dy++)
-				hits += SQUARE(xo*n + dx) + SQUARE(yo*n + dy) <= SQUARE(r*n);
-			if (hits)
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), SETA(c, A(c)*hits/SQUARE(n)));
+				h[x] += SQUARE(xo + dx*STAMPQ) + SQUARE(yo + dy*STAMPQ) <= SQUARE(r*q);
+			if (h[x] && !s->x1[y])
+				s->x0[y] = x;
+			if (h[x])
+				s->x1[y] = x + 1;
+			if (h[x] == SQUARE(n) && !s->i1[y])
+				s->i0[y] = x;
+			if (h[x] == SQUARE(n))
+				s->i1[y] = x + 1;
 		}
+		if (s->i0[y] == s->i1[y])
+			s->i0[y] = s->i1[y] = s->x1[y];
+	}
+}
+
+static Stamp *stamp(I64 r, I64 fx, I64 fy)
+{
+	Stamp *s = &stamps[r][fx][fy];
+	U32 st = StampEmpty;
+	if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == StampReady)
+		return s;
+	if (__atomic_compare_exchange_n(&s->state, &st, StampBuilding, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		stampbuild(s, r, fx, fy);
+		__atomic_store_n(&s->state, StampReady, __ATOMIC_RELEASE);
 	}
+	/* NOTE: building takes a few microseconds, so just wait for the other thread */
+	while (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != StampReady)
+		;
+	return s;
+}
+
+static void stampfringe(Image *i, I64 y, I64 xo, U8 *h, I64 x0, I64 x1, U8 *lut, Color c)
+{
+	U8 a[STAMPW];
+	x0 = CLIPX(i, xo + x0), x1 = CLIPX(i, xo + x1);
+	for (I64 x = x0; x < x1; x++)
+		a[x - x0] = lut[h[x - xo]];
+	if (x0 < x1)
+		cover(i, y, x0, a, x1 - x0, c);
+}
+
+static void drawstamp(Image *i, Stamp *s, I64 xo, I64 yo, I64 r, Color c)
+{
+	U8 lut[10];
+	for (I64 h = 0; h < 10; h++)
+		lut[h] = A(c)*h/9;
+	for (I64 y = CLIPY(i, yo); y < CLIPY(i, yo + 2*r + 2); y++) {
+		I64 k = y - yo;
+		U8 *h = &s->hits[k*STAMPW];
+		stampfringe(i, y, xo, h, s->x0[k], s->i0[k], lut, c);
+		span(i, y, CLIPX(i, xo + s->i0[k]), CLIPX(i, xo + s->i1[k]), c);
+		stampfringe(i, y, xo, h, s->i1[k], s->x1[k], lut, c);
+	}
+}
+
+static void smoothcircle(Image *i, I16 xc, I16 yc, I16 r, Color c)
+{
+	if (r < 0)
+		return;
+	if (r <= STAMPMAXR) {
+		drawstamp(i, stamp(r, 0, 0), xc - r, yc - r, r, c);
+		return;
+	}
+	const I64 n = 3; /* NOTE: looks ok */
+	/* NOTE: points closer than that to the center on both axes are
+	 * definitely inside the circle along with their neighbours */
+	I64 ri = r*45/64;
+	U8 a[256];
+	for (I64 y = CLIPY(i, yc-r); y < CLIPY(i, yc+r+1); y++) {
+		I64 yo = iabs(y-yc);
+		I64 x0 = CLIPX(i, xc-r), x1 = CLIPX(i, xc+r+1);
+		I64 xi0 = x1, xi1 = x1;
+		if (yo < ri)
+			xi0 = CLIPX(i, xc-ri+1), xi1 = CLIPX(i, xc+ri);
+		/* NOTE: the interior can get clipped away completely */
+		if (xi0 == xi1)
+			xi0 = xi1 = x1;
+		for (I64 x = x0; x < x1;) {
+			if (x == xi0) {
+				span(i, y, xi0, xi1, c);
+				x = xi1;
+				continue;
+			}
+			I64 m = 0, xe = x < xi0 ? xi0 : x1;
+			for (; x + m < xe && m < (I64)sizeof(a); m++) {
+				I64 xo = iabs(x+m-xc), hits = 0;
+				for (I64 dx = 0; dx < n; dx++)
+				for (I64 dy = 0; dy < n; dy++)
+					hits += SQUARE(xo*n + dx) + SQUARE(yo*n + dy) <= SQUARE(r*n);
+				a[m] = A(c)*hits/SQUARE(n);
+			}
+			cover(i, y, x, a, m, c);
+			x += m;
+		}
+	}
+}
+
+void drawsmoothcircle(Image *i, I16 xc, I16 yc, I16 r, Color c)
+{
+	if (record(i, (Cmd){CmdSmoothCircle, 0, {xc, yc, r}, c, i->mode}))
+		return;
+	smoothcircle(i, xc, yc, r, c);
+}
+
+static void smoothdot(Image *i, I16 x, I16 y, I16 fx, I16 fy, I16 r, Color c)
+{
+	if (record(i, (Cmd){CmdSmoothDot, 0, {x, y, r, fx, fy}, c, i->mode}))
+		return;
+	if (r < 0)
+		return;
+	if (r > STAMPMAXR) {
+		smoothcircle(i, x + (fx >= STAMPQ/2), y + (fy >= STAMPQ/2), r, c);
+		return;
+	}
+	drawstamp(i, stamp(r, fx, fy), x - r, y - r, r, c);
+}
+
+void drawsmoothdot(Image *i, I64 xc, I64 yc, I16 r, Color c)
+{
+	/* NOTE: the center is rounded to the nearest 1/STAMPQ of a pixel */
+	I64 qx = (xc*STAMPQ + FIX/2) >> FIXBITS, qy = (yc*STAMPQ + FIX/2) >> FIXBITS;
+	I64 x = CLAMP(qx >> STAMPQBITS, MINVAL(I16), MAXVAL(I16));
+	I64 y = CLAMP(qy >> STAMPQBITS, MINVAL(I16), MAXVAL(I16));
+	smoothdot(i, x, y, qx & (STAMPQ-1), qy & (STAMPQ-1), r, c);
 }
 
 void drawrect(Image *i, I16 xtl, I16 ytl, I16 w, I16 h, Color c)
 {
+	if (record(i, (Cmd){CmdRect, 0, {xtl, ytl, w, h}, c, i->mode}))
+		return;
 	if (w < 0) {
 		xtl += w;
 		w = -w;
@@ -160,8 +1028,7 @@ void drawrect(Image *i, I16 xtl, I16 ytl, I16 w, I16 h, Color c)
 		h = -h;
 	}
 	for (I64 y = CLIPY(i, ytl); y < CLIPY(i, ytl+h); y++)
-	for (I64 x = CLIPX(i, xtl); x < CLIPX(i, xtl+w); x++)
-		PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+		span(i, y, CLIPX(i, xtl), CLIPX(i, xtl+w), c);
 }
 
 /* To explain the core idea, let's consider a line with a shallow slope:
@@ -183,7 +1050,31 @@ void drawrect(Image *i, I16 xtl, I16 ytl, I16 w, I16 h, Color c)
  * But that's not all. Integer division is truncating, while ideally
  * we'd like the result to be rounded. Hence we actually move up
  * not when [e >= dx] but when [e*2 >= dx]. */
+/* NOTE: Bresenham goes m(k) = floor((2k*dm + dM)/(2dM)) pixels along the minor
+ * axis after k steps along the major one. Since m(k) never decreases, the steps
+ * where o + s*m(k) stays within [0, lim) form a range, and [*k0, *k1) gets
+ * narrowed down to it, so the loop never visits pixels outside of the image. */
+static void lineclip(I64 o, I64 s, I64 dM, I64 dm, I64 lim, I64 *k0, I64 *k1)
+{
+	if (!s) {
+		if (o < 0 || o >= lim)
+			*k1 = *k0;
+		return;
+	}
+	I64 lo = s > 0 ? -o : o - lim + 1, hi = s > 0 ? lim - 1 - o : o;
+	*k0 = MAX(*k0, -divfloor((1 - 2*lo)*dM, 2*dm));
+	*k1 = MIN(*k1, -divfloor(-(2*hi + 1)*dM, 2*dm));
+}
+
 void drawline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, Color c)
+{
+	if (record(i, (Cmd){CmdLine, 0, {x1, y1, x2, y2}, c, i->mode}))
+		return;
+	Blendfn *bl = blender(i, &c);
+	blendline(i, x1, y1, x2, y2, bl, c);
+}
+
+static void blendline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, Blendfn *bl, Color c)
 {
 	I64 dx = iabs(x2-x1), dy = iabs(y2-y1);
 	if (dx + dy == 0)
@@ -191,53 +1082,159 @@ void drawline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, Color c)
 	/* NOTE: we always exclude (x2, y2), because it solves the problem
 	 * of double-painting pixels when we draw a contour of semi-transparent lines. */
 	if (dx >= dy) {
-		I64 xmin, xmax, sy, d, y;
+		I64 xmin, xmax, xo, yo, sy;
 		if (x1 > x2) {
 			xmin = CLIPX(i, x2+1), xmax = CLIPX(i, x1+1);
-			sy = SIGN(y1-y2), d = (xmin-x2)*dy, y = y2 + sy*(d/dx);
+			xo = x2, yo = y2, sy = SIGN(y1-y2);
 		} else {
 			xmin = CLIPX(i, x1), xmax = CLIPX(i, x2);
-			sy = SIGN(y2-y1), d = (xmin-x1)*dy, y = y1 + sy*(d/dx);
+			xo = x1, yo = y1, sy = SIGN(y2-y1);
 		}
-		for (I64 x = xmin, e = d%dx; x < xmax; x++, e += dy) {
+		I64 k0 = xmin - xo, k1 = xmax - xo;
+		lineclip(yo, sy, dx, dy, i->h, &k0, &k1);
+		if (k0 >= k1)
+			return;
+		I64 d = k0*dy, y = yo + sy*(d/dx);
+		Color *p = &PIXEL(i, xo + k0, y);
+		for (I64 k = k0, e = d%dx; k < k1; k++, p++, e += dy) {
 			if (e*2 >= dx)
-				y += sy, e -= dx;
-			if (CHECKY(i, y))
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+				p += sy*i->s, e -= dx;
+			*p = bl(*p, c);
 		}
 	} else {
-		I64 ymin, ymax, sx, d, x;
+		I64 ymin, ymax, xo, yo, sx;
 		if (y1 > y2) {
 			ymin = CLIPY(i, y2+1), ymax = CLIPY(i, y1+1);
-			sx = SIGN(x1-x2), d = (ymin-y2)*dx, x = x2 + sx*(d/dy);
+			xo = x2, yo = y2, sx = SIGN(x1-x2);
 		} else {
 			ymin = CLIPY(i, y1), ymax = CLIPY(i, y2);
-			sx = SIGN(x2-x1), d = (ymin-y1)*dx, x = x1 + sx*(d/dy);
+			xo = x1, yo = y1, sx = SIGN(x2-x1);
 		}
-		for (I64 y = ymin, e = d%dy; y < ymax; y++, e += dx) {
+		I64 k0 = ymin - yo, k1 = ymax - yo;
+		lineclip(xo, sx, dy, dx, i->w, &k0, &k1);
+		if (k0 >= k1)
+			return;
+		I64 d = k0*dx, x = xo + sx*(d/dy);
+		Color *p = &PIXEL(i, x, yo + k0);
+		for (I64 k = k0, e = d%dy; k < k1; k++, p += i->s, e += dx) {
 			if (e*2 >= dy)
-				x += sx, e -= dy;
-			if (CHECKX(i, x))
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+				p += sx, e -= dy;
+			*p = bl(*p, c);
 		}
 	}
 }
 
+/* NOTE: same pixels as drawline, but for lines known to lie inside
+ * the image, so there is no clipping and the loop steps the pointer */
+static void lineinside(Image *i, I64 x1, I64 y1, I64 x2, I64 y2, Blendfn *bl, Color c)
+{
+	I64 dx = iabs(x2-x1), dy = iabs(y2-y1);
+	if (dx + dy == 0)
+		return;
+	if (dx >= dy) {
+		I64 x = x1, y = y1, sy = SIGN(y2-y1), e = 0;
+		if (x1 > x2)
+			x = x2+1, sy = SIGN(y1-y2), y = y2 + sy*(dy/dx), e = dy%dx;
+		Color *p = &PIXEL(i, x, y);
+		for (I64 k = 0; k < dx; k++, p++, e += dy) {
+			if (e*2 >= dx)
+				p += sy*i->s, e -= dx;
+			*p = bl(*p, c);
+		}
+	} else {
+		I64 x = x1, y = y1, sx = SIGN(x2-x1), e = 0;
+		if (y1 > y2)
+			y = y2+1, sx = SIGN(x1-x2), x = x2 + sx*(dx/dy), e = dx%dy;
+		Color *p = &PIXEL(i, x, y);
+		for (I64 k = 0; k < dy; k++, p += i->s, e += dx) {
+			if (e*2 >= dy)
+				p += sx, e -= dy;
+			*p = bl(*p, c);
+		}
+	}
+}
+
+/* NOTE: draws the segments without recording them or adding their damage */
+static void polyline(Image *i, I16 (*p)[2], I64 n, Color c)
+{
+	OK inside = 1;
+	for (I64 k = 0; k < n && inside; k++)
+		inside = CHECKX(i, p[k][0]) && CHECKY(i, p[k][1]);
+	Blendfn *bl = blender(i, &c);
+	for (I64 k = 1; k < n; k++) {
+		if (inside)
+			lineinside(i, p[k-1][0], p[k-1][1], p[k][0], p[k][1], bl, c);
+		else
+			blendline(i, p[k-1][0], p[k-1][1], p[k][0], p[k][1], bl, c);
+	}
+}
+
+void drawpolyline(Image *i, I16 (*p)[2], I64 n, Color c)
+{
+	if (deferred(i)) {
+		for (I64 k = 1; k < n; k++)
+			drawline(i, p[k-1][0], p[k-1][1], p[k][0], p[k][1], c);
+		return;
+	}
+	/* NOTE: one rect for the whole polyline, and none when replaying */
+	if (n > 1 && !defdraw.syncing && !defdraw.counted && __atomic_load_n(&damages.n, __ATOMIC_RELAXED)) {
+		I64 x0 = MAXVAL(I16), y0 = MAXVAL(I16), x1 = MINVAL(I16), y1 = MINVAL(I16);
+		for (I64 k = 0; k < n; k++) {
+			x0 = MIN(x0, p[k][0]), x1 = MAX(x1, p[k][0]);
+			y0 = MIN(y0, p[k][1]), y1 = MAX(y1, p[k][1]);
+		}
+		adddamage(i, x0, y0, x1 + 1, y1 + 1);
+	}
+	polyline(i, p, n, c);
+}
+
+/* NOTE: The distance between a quadratic curve and its chord is at most
+ * |p1 - 2p2 + p3|/4, and splitting the curve into n pieces divides that by n^2,
+ * so sqrt(|p1 - 2p2 + p3|) pieces keep it below a quarter of a pixel.
+ * The points are then stepped with forward differences:
+ *     p(k + 1) - p(k) = 2(p2 - p1)/n + (2k + 1)(p1 - 2p2 + p3)/n^2. */
+#define BEZBITS 32
+#define BEZONE ((I64)1 << BEZBITS)
+#define BEZMAXN 512
+
 void drawbezier(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c)
 {
-	const I64 n = 64, n2=n*n; /* NOTE: looks ok */
-	for (I64 t = 1, xp = x1, yp = y1; t <= n; t++) {
-		I64 x = divround((n-t)*(n-t)*x1 + 2*(n-t)*t*x2 + t*t*x3, n2);
-		I64 y = divround((n-t)*(n-t)*y1 + 2*(n-t)*t*y2 + t*t*y3, n2);
-		drawline(i, xp, yp, x, y, c);
-		xp = x, yp = y;
+	if (record(i, (Cmd){CmdBezier, 0, {x1, y1, x2, y2, x3, y3}, c, i->mode}))
+		return;
+	I64 ddx = x1 - 2*x2 + x3, ddy = y1 - 2*y2 + y3;
+	I64 n = MIN((I64)isqrt(isqrt(ddx*ddx + ddy*ddy)) + 1, BEZMAXN);
+	I16 p[BEZMAXN + 1][2];
+	I64 x = x1*BEZONE + BEZONE/2, y = y1*BEZONE + BEZONE/2;
+	I64 dx = (2*(x2 - x1)*n + ddx)*BEZONE/(n*n);
+	I64 dy = (2*(y2 - y1)*n + ddy)*BEZONE/(n*n);
+	ddx = 2*ddx*BEZONE/(n*n), ddy = 2*ddy*BEZONE/(n*n);
+	p[0][0] = x1, p[0][1] = y1;
+	for (I64 k = 1; k < n; k++) {
+		x += dx, y += dy;
+		dx += ddx, dy += ddy;
+		p[k][0] = x >> BEZBITS, p[k][1] = y >> BEZBITS;
 	}
+	p[n][0] = x3, p[n][1] = y3;
+	/* NOTE: record has added the damage of the curve already */
+	polyline(i, p, n + 1, c);
 }
 
 void drawpixel(Image *i, I16 x, I16 y, Color c)
+{
+	if (record(i, (Cmd){CmdPixel, 0, {x, y}, c, i->mode}))
+		return;
+	if (CHECKX(i, x) && CHECKY(i, y)) {
+		Blendfn *bl = blender(i, &c);
+		PIXEL(i, x, y) = bl(PIXEL(i, x, y), c);
+	}
+}
+
+/* NOTE: the damage of the whole ring is added by record, so the pixels
+ * are put directly instead of through drawpixel */
+static void ringpixel(Image *i, I64 x, I64 y, Blendfn *bl, Color c)
 {
 	if (CHECKX(i, x) && CHECKY(i, y))
-		PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
+		PIXEL(i, x, y) = bl(PIXEL(i, x, y), c);
 }
 
 /* TODO: implement arc drawing */
@@ -245,20 +1242,23 @@ void drawpixel(Image *i, I16 x, I16 y, Color c)
  * and then use symmetry to reconstruct the others */
 void drawring(Image *i, I16 xc, I16 yc, I16 r, Color c)
 {
+	if (record(i, (Cmd){CmdRing, 0, {xc, yc, r}, c, i->mode}))
+		return;
+	Blendfn *bl = blender(i, &c);
 	I64 y = r, y2 = y*y, x = 0, x2 = 0;
 	while (y >= x) {
-		drawpixel(i, xc + x, yc - y, c);
-		drawpixel(i, xc + y, yc + x, c);
+		ringpixel(i, xc + x, yc - y, bl, c);
+		ringpixel(i, xc + y, yc + x, bl, c);
 		if (x) {
-			drawpixel(i, xc - x, yc - y, c);
-			drawpixel(i, xc - x, yc + y, c);
+			ringpixel(i, xc - x, yc - y, bl, c);
+			ringpixel(i, xc - x, yc + y, bl, c);
 		}
 		if (x != y) {
-			drawpixel(i, xc - y, yc - x, c);
-			drawpixel(i, xc + x, yc + y, c);
+			ringpixel(i, xc - y, yc - x, bl, c);
+			ringpixel(i, xc + x, yc + y, bl, c);
 			if (x) {
-				drawpixel(i, xc + y, yc - x, c);
-				drawpixel(i, xc - y, yc + x, c);
+				ringpixel(i, xc + y, yc - x, bl, c);
+				ringpixel(i, xc - y, yc + x, bl, c);
 			}
 		}
 		x2 += x*2 + 1, x += 1;
@@ -267,43 +1267,539 @@ void drawring(Image *i, I16 xc, I16 yc, I16 r, Color c)
 	}
 }
 
-/* TODO: try converting to integer-only computations */
-/* NOTE: this function does distance-based AA */
-static void drawthicknonsteep(Image *i, U8 flip, I16 xlim, I16 ylim, I16 x1, I16 y1, I16 x2, I16 y2, U8 w, Color c)
+/* NOTE: narrows [*x0, *x1) down to the x where a*x + b >= 0 */
+static void halfplane(I64 a, I64 b, I64 *x0, I64 *x1)
 {
-	if (x1 > x2) {
-		SWAP(x1, x2);
-		SWAP(y1, y2);
-	}
-	F64 dx = x2 - x1, dy = y2 - y1;
-	F64 invl  = 1 / fsqrt(dx*dx + dy*dy);
-	F64 invdx = 1 / dx;
-	I64 xmin = CLAMP(x1 - 2*w, 0, xlim), xmax = CLAMP(x2 + 2*w+1, 0, xlim);
-	for (I64 x = xmin; x < xmax; x++) {
-		F64 yc = y1 + (x - x1)*dy*invdx;
-		I64 ymin = CLAMP(yc-2*w, 0, ylim), ymax = CLAMP(yc+2*w+1, 0, ylim);
-		F64 o1 = (x - x1)*dx + (ymin - y1)*dy;
-		F64 o2 = (x - x2)*dx + (ymin - y2)*dy;
-		F64 d  = (ymin - y1)*dx - (x - x1)*dy;
-		for (I64 y = ymin; y < ymax; y++) {
-			if (o1 >= 0 && o2 <= 0) {
-				U8 a = smoothstep(w+1, w-1, fabs(d)*invl) * A(c);
-				if (flip)
-					PIXEL(i, y, x) = blend(PIXEL(i, y, x), SETA(c, a));
-				else
-					PIXEL(i, x, y) = blend(PIXEL(i, x, y), SETA(c, a));
+	if (a > 0)
+		*x0 = MAX(*x0, -divfloor(b, a));
+	else if (a < 0)
+		*x1 = MIN(*x1, divfloor(b, -a) + 1);
+	else if (b < 0)
+		*x1 = *x0;
+}
+
+/* NOTE: narrows [*r0, *r1) down to the part of the row y where |d| <= k
+ * (see below), between the caps at both ends of the line */
+static void thickrow(I64 y, I64 x1, I64 y1, I64 x2, I64 y2, I64 k, I64 *r0, I64 *r1)
+{
+	I64 dx = x2 - x1, dy = y2 - y1;
+	halfplane(dx, (y - y1)*dy - x1*dx, r0, r1);
+	halfplane(-dx, x2*dx - (y - y2)*dy, r0, r1);
+	halfplane(dy, k - (y - y1)*dx - x1*dy, r0, r1);
+	halfplane(-dy, k + (y - y1)*dx + x1*dy, r0, r1);
+}
+
+/* NOTE: smoothstep(w+1, w-1, |d|/l) in 16.16, l is 20.12 */
+static U8 thickalpha(I64 d, I64 l, I64 w, U8 a)
+{
+	I64 t = CLAMP((((w + 1) << 16) - ((I64)iabs(d) << 28)/l)/2, 0, 1 << 16);
+	I64 s = (t*t >> 16)*(3*(1 << 16) - 2*t) >> 16;
+	return s*a >> 16;
+}
+
+/* NOTE: This does distance-based AA: a pixel between the caps gets
+ * smoothstep(w+1, w-1, dist)*A(c), where dist is its distance to the line.
+ * For d = (y - y1)*dx - (x - x1)*dy that distance is |d|/l, so the pixels
+ * closer than w-1 (full opacity) and the ones closer than w+1 (anything
+ * visible at all) are exactly |d| <= isqrt((w-1)^2*l^2) and
+ * |d| <= isqrt((w+1)^2*l^2 - 1) in integers. Both are intervals on each row,
+ * so rows are walked in memory order and only the fringe around the inner
+ * span needs the (fixed point) smoothstep. */
+static void thickline(Image *i, I64 x1, I64 y1, I64 x2, I64 y2, I64 w, Color c)
+{
+	I64 l2 = SQUARE(x2 - x1) + SQUARE(y2 - y1);
+	I64 l = isqrt(l2 << 24);
+	I64 ko = isqrt(SQUARE(w + 1)*l2 - 1), ki = w ? (I64)isqrt(SQUARE(w - 1)*l2) : -1;
+	U8 a[256];
+	for (I64 y = CLIPY(i, MIN(y1, y2) - w - 1); y < CLIPY(i, MAX(y1, y2) + w + 2); y++) {
+		I64 xo0 = 0, xo1 = i->w, xi0 = 0, xi1 = i->w;
+		thickrow(y, x1, y1, x2, y2, ko, &xo0, &xo1);
+		if (xo0 >= xo1)
+			continue;
+		if (ki >= 0)
+			thickrow(y, x1, y1, x2, y2, ki, &xi0, &xi1);
+		if (ki < 0 || xi0 >= xi1)
+			xi0 = xi1 = xo1;
+		for (I64 x = xo0; x < xo1;) {
+			if (x == xi0) {
+				span(i, y, xi0, xi1, c);
+				x = xi1;
+				continue;
 			}
-			o1 += dy, o2 += dy, d += dx;
+			I64 m = 0, xe = x < xi0 ? xi0 : xo1;
+			for (; x + m < xe && m < (I64)sizeof(a); m++)
+				a[m] = thickalpha((y - y1)*(x2 - x1) - (x + m - x1)*(y2 - y1), l, w, A(c));
+			cover(i, y, x, a, m, c);
+			x += m;
 		}
 	}
 }
 
 void drawthickline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, U8 w, Color c)
 {
+	if (record(i, (Cmd){CmdThickLine, w, {x1, y1, x2, y2}, c, i->mode}))
+		return;
 	if (iabs(x2-x1) + iabs(y2-y1) == 0)
 		return;
-	if (iabs(x2-x1) >= iabs(y2-y1))
-		drawthicknonsteep(i, 0, i->w, i->h, x1, y1, x2, y2, w, c);
-	else
-		drawthicknonsteep(i, 1, i->h, i->w, y1, x1, y2, x2, w, c);
+	thickline(i, x1, y1, x2, y2, w, c);
+}
+
+static F64 step(F64 v, F64 lim, F64 dir)
+{
+	return dir*MIN(ffloor(dir*v + 1), dir*lim);
+}
+
+static F64 adv(F64 v, F64 a, F64 lim, F64 dir)
+{
+	return dir*MIN(dir*(v + a), dir*lim);
+}
+
+/*
+ * The idea of this approach is to use pixel coverage as opacity.
+ * To find the coverage values we incrementally build the signed area
+ * difference array.
+ *
+ *          i                  i+1
+ * .------------------.------------------.
+ * |        (x, y)    |                  |
+ * |__________,_______|__________________|  Each line segment contained within one pixel
+ * |         /        |                  |  adds Sr to the containing pixel (i) and (yn - y)
+ * |        /         |                  |  to all the pixels to the right of it.
+ * |  Sl   /    Sr    |                  |  Since (yn - y) = Sr + Sl, we should simply
+ * |      /           |                  |  add Sr and Sl to i-th and i+1-st pixel's array
+ * |_____/____________|__________________|  values respectively.
+ * |  (xn, yn)        |                  |
+ * '------------------'------------------'
+ */
+static void putcell(Cells *c, I64 x, I64 y, F64 a)
+{
+	if (c->n == c->cap) {
+		c->cap = c->cap*2 + 256;
+		c->c = memrealloc(c->c, c->cap*sizeof(c->c[0]));
+	}
+	c->c[c->n++] = (Cell){(U32)y << 16 | x, a};
+}
+
+void cellline(Cells *c, F64 x1, F64 y1, F64 x2, F64 y2)
+{
+	if (y1 == y2)
+		return;
+	F64 dx = x2 - x1, sx = SIGN(dx);
+	F64 dy = y2 - y1, sy = SIGN(dy);
+	for (F64 x = x1, y = y1; y != y2;) {
+		F64 xn = step(x, x2, sx), xd = xn - x;
+		F64 yn = step(y, y2, sy), yd = yn - y;
+		if (dx) {
+			if (xd && fabs(dy*xd) < fabs(yd*dx))
+				yn = adv(y, dy/dx*xd, yn, sy);
+			else
+				xn = adv(x, dx/dy*yd, xn, sx);
+		} else {
+			xn = x;
+		}
+		F64 xm = (x + xn)/2, ym = (y + yn)/2;
+		I16 px = ffloor(xm), py = ffloor(ym);
+		F64 d = yn - y, f = xm - px;
+		if (py >= 0 && py < c->h) {
+			if (px < c->w)
+				putcell(c, MAX(px, 0),   py, d*(1 - f));
+			if (px < c->w-1)
+				putcell(c, MAX(px+1, 0), py, d*f);
+		}
+		x = xn, y = yn;
+	}
+}
+
+void cellquad(Cells *f, F64 x1, F64 y1, F64 x2, F64 y2, F64 x3, F64 y3)
+{
+	F64 l2  = (x3 - x1)*(x3 - x1) + (y3 - y1)*(y3 - y1);
+	F64 dot = (x2 - x1)*(y3 - y1) - (y2 - y1)*(x3 - x1);
+	if (dot*dot <= .25*l2) {
+		/* control is less than half pixel away */
+		cellline(f, x1, y1, x3, y3);
+		return;
+	}
+	F64 lx = (x1 + x2)/2, ly = (y1 + y2)/2;
+	F64 rx = (x2 + x3)/2, ry = (y2 + y3)/2;
+	F64 mx = (lx + rx)/2, my = (ly + ry)/2;
+	cellquad(f, x1, y1, lx, ly, mx, my);
+	cellquad(f, mx, my, rx, ry, x3, y3);
+}
+
+/* NOTE: cells are sorted by their (y, x) keys, a byte per pass */
+static void cellsort(Cell *c, Cell *t, I64 n)
+{
+	for (U32 sh = 0; sh < 32; sh += 8) {
+		I64 cnt[257] = {0};
+		for (I64 k = 0; k < n; k++)
+			cnt[(c[k].k >> sh & 0xFF) + 1] += 1;
+		for (I64 d = 0; d < 256; d++)
+			cnt[d+1] += cnt[d];
+		for (I64 k = 0; k < n; k++)
+			t[cnt[c[k].k >> sh & 0xFF]++] = c[k];
+		SWAP(c, t);
+	}
+}
+
+static U8 fillalpha(F64 a, U8 rule, U8 alpha)
+{
+	a = fabs(a);
+	if (rule == FillEvenodd) {
+		a -= 2*ffloor(a/2);
+		a = a > 1 ? 2 - a : a;
+	}
+	return MIN(a, 1)*alpha + .5;
+}
+
+/* NOTE: between two cells of a row the accumulated area doesn't change,
+ * so a row is a handful of constant runs: fully covered ones get filled,
+ * the rest are gathered and blended in one go */
+static void pathrow(Image *i, I64 y, Cell *c, I64 n, U8 rule, Color col)
+{
+	U8 a[256];
+	I64 m = 0, x0 = 0;
+	F64 acc = 0;
+	for (I64 k = 0; k < n;) {
+		I64 x = CELLX(c[k]);
+		for (; k < n && CELLX(c[k]) == x; k++)
+			acc += c[k].a;
+		I64 xe = k < n ? CELLX(c[k]) : i->w;
+		U8 v = fillalpha(acc, rule, A(col));
+		if (m && (!v || (v == A(col) && xe - x > 8) || x0 + m != x)) {
+			cover(i, y, x0, a, m, col);
+			m = 0;
+		}
+		if (!v)
+			continue;
+		if (v == A(col) && xe - x > 8) {
+			span(i, y, x, xe, col);
+			continue;
+		}
+		for (; x < xe; x++) {
+			if (m == (I64)sizeof(a)) {
+				cover(i, y, x0, a, m, col);
+				m = 0;
+			}
+			if (!m)
+				x0 = x;
+			a[m++] = v;
+		}
+	}
+	if (m)
+		cover(i, y, x0, a, m, col);
+}
+
+void drawpath(Image *i, Segment *s, I64 n, U8 rule, Color col)
+{
+	/* NOTE: paths don't fit into commands, they go right after what was recorded */
+	if (deferred(i))
+		drawsync();
+	Cells c = {0, 0, 0, i->w, i->h};
+	I64 x0 = MAXVAL(I16), y0 = MAXVAL(I16), x1 = MINVAL(I16), y1 = MINVAL(I16);
+	for (I64 k = 0; k < n; k++) {
+		U8 np = s[k].type == SegLine ? 2 : 3;
+		for (U8 j = 0; j < np; j++) {
+			x0 = MIN(x0, s[k].x[j]), x1 = MAX(x1, s[k].x[j]);
+			y0 = MIN(y0, s[k].y[j]), y1 = MAX(y1, s[k].y[j]);
+		}
+		if (s[k].type == SegLine)
+			cellline(&c, s[k].x[0], s[k].y[0], s[k].x[1], s[k].y[1]);
+		else
+			cellquad(&c, s[k].x[0], s[k].y[0], s[k].x[1], s[k].y[1], s[k].x[2], s[k].y[2]);
+	}
+	adddamage(i, x0, y0, x1 + 1, y1 + 1);
+	if (!c.n)
+		return;
+	Cell *t = memalloc(c.n*sizeof(t[0]));
+	cellsort(c.c, t, c.n);
+	for (I64 k = 0, e; k < c.n; k = e) {
+		for (e = k; e < c.n && CELLY(c.c[e]) == CELLY(c.c[k]); e++)
+			;
+		pathrow(i, CELLY(c.c[k]), c.c + k, e - k, rule, col);
+	}
+	memfree(t);
+	memfree(c.c);
+}
+
+typedef struct {
+	I32 y, x0, x1;
+} Floodseg;
+
+typedef struct {
+	Image   *i;
+	Color   t, mask;
+	U8      tol;
+	U64     *seen;
+	Floodseg *s;
+	I64     n, cap;
+} Flood;
+
+static OK floodmatch(Flood *f, I64 x, I64 y)
+{
+	U64 k = (U64)y*f->i->w + x;
+	if (f->seen[k/64] >> (k%64) & 1)
+		return 0;
+	Color p = PIXEL(f->i, x, y);
+	for (U32 sh = 0; sh < 32; sh += 8) {
+		I64 d = (I64)(p >> sh & 0xFF) - (I64)(f->t >> sh & 0xFF);
+		if ((f->mask >> sh & 0xFF) && iabs(d) > f->tol)
+			return 0;
+	}
+	return 1;
+}
+
+static void floodpush(Flood *f, I64 y, I64 x0, I64 x1)
+{
+	if (y < 0 || y >= f->i->h)
+		return;
+	if (f->n == f->cap) {
+		f->cap = f->cap*2 + 256;
+		f->s = memrealloc(f->s, f->cap*sizeof(f->s[0]));
+	}
+	f->s[f->n++] = (Floodseg){y, x0, x1};
+}
+
+/* NOTE: Every popped segment is scanned for runs of matching pixels, which
+ * are extended to both sides, marked as seen, blended and then their rows
+ * above and below get pushed. A pixel is filled once and scanned at most
+ * a few times, and the seen bitmap also keeps the blended pixels from
+ * matching again. */
+void drawfill(Image *i, I16 x, I16 y, U8 tol, Color mask, Color c)
+{
+	if (!CHECKX(i, x) || !CHECKY(i, y))
+		return;
+	if (deferred(i))
+		drawsync();
+	U64 nw = ((U64)i->w*i->h + 63)/64;
+	Flood f = {i, PIXEL(i, x, y), mask, tol, memalloc(nw*sizeof(U64)), 0, 0, 0};
+	for (U64 k = 0; k < nw; k++)
+		f.seen[k] = 0;
+	I64 bx0 = x, by0 = y, bx1 = x, by1 = y;
+	floodpush(&f, y, x, x + 1);
+	while (f.n) {
+		Floodseg s = f.s[--f.n];
+		for (I64 xs = s.x0; xs < s.x1; xs++) {
+			if (!floodmatch(&f, xs, s.y))
+				continue;
+			I64 l = xs, r = xs + 1;
+			while (l > 0 && floodmatch(&f, l - 1, s.y))
+				l--;
+			while (r < i->w && floodmatch(&f, r, s.y))
+				r++;
+			for (U64 k = (U64)s.y*i->w + l; k < (U64)s.y*i->w + r; k++)
+				f.seen[k/64] |= (U64)1 << (k%64);
+			span(i, s.y, l, r, c);
+			floodpush(&f, s.y - 1, l, r);
+			floodpush(&f, s.y + 1, l, r);
+			bx0 = MIN(bx0, l), bx1 = MAX(bx1, r);
+			by0 = MIN(by0, s.y), by1 = MAX(by1, s.y);
+			xs = r;
+		}
+	}
+	adddamage(i, bx0, by0, bx1, by1 + 1);
+	memfree(f.s);
+	memfree(f.seen);
+}
+
+/* NOTE: Source positions are 32.32 fixed point and advance by a constant
+ * step, the destination pixel k of the rect maps to the source point
+ * (k + 1/2)*sw/w, so same-size blits are plain copies and bilinear
+ * filtering is centered. Bilinear rows are first mixed vertically for
+ * the whole row, then horizontally pixel by pixel. */
+#define BLITBAND 32 /* rows */
+
+typedef struct {
+	Image *i, *s;
+	I64   x, y, w, h;
+	I64   x0, x1, y0, y1;
+	I64   u0, du, v0, dv;
+	U8    flags;
+	U8    *mem; /* NOTE: scratch of the bands, the allocator isn't thread-safe */
+	U64   memstride;
+} Blit;
+
+/* NOTE: split in two, so the dividend doesn't overflow */
+static I64 blitorigin(I64 d, I64 sw, I64 w, OK centered)
+{
+	I64 p = (2*d + 1)*sw;
+	I64 u = (p/(2*w) << 32) + ((p%(2*w)) << 32)/(2*w);
+	return centered ? u - ((I64)1 << 31) : u;
+}
+
+/* NOTE: every row samples the same columns, they are computed once
+ * per band: source index and, for bilinear, the weight of the next one */
+static void blitcols(Blit *b, U32 *xs, U8 *fx)
+{
+	I64 n = b->x1 - b->x0, u = b->u0, umax = (I64)(b->s->w - 1) << 32;
+	for (I64 k = 0; k < n; k++, u += b->du) {
+		I64 uc = CLAMP(u, 0, umax);
+		xs[k] = uc >> 32, fx[k] = uc >> 24 & 0xFF;
+	}
+}
+
+static void blitrow(Blit *b, I64 y, U32 *xs, U8 *fx, Color *out, Color *tmp)
+{
+	Image *s = b->s;
+	I64 n = b->x1 - b->x0;
+	I64 v = b->v0 + (y - b->y0)*b->dv;
+	if (!(b->flags & BlitBilinear)) {
+		Color *row = &PIXEL(s, 0, v >> 32);
+		if (b->du == (I64)1 << 32) {
+			__builtin_memcpy(out, row + xs[0], n*sizeof(out[0]));
+			return;
+		}
+		for (I64 k = 0; k < n; k++)
+			out[k] = row[xs[k]];
+		return;
+	}
+	/* NOTE: the edge pixels get extended by clamping, the last column has
+	 * zero weight for its (nonexistent) right neighbour */
+	v = CLAMP(v, 0, (I64)(s->h - 1) << 32);
+	I64 sy = v >> 32, sy1 = MIN(sy + 1, s->h - 1);
+	I64 sx0 = xs[0], sx1 = MIN(xs[n-1] + 2, s->w);
+	lerpspan(tmp + sx0, &PIXEL(s, sx0, sy), &PIXEL(s, sx0, sy1), v >> 24 & 0xFF, sx1 - sx0);
+	lerpgather(out, tmp, xs, fx, n);
+}
+
+static void blitband(void *ctx, U64 band)
+{
+	Blit *b = ctx;
+	Image *i = b->i, *s = b->s;
+	I64 n = b->x1 - b->x0;
+	OK topm = s->mode != ImagePremul && i->mode == ImagePremul;
+	OK frompm = s->mode == ImagePremul && i->mode != ImagePremul;
+	OK direct = !(b->flags & BlitBlend) && !topm && !frompm;
+	U8 *mem = b->mem + band*b->memstride;
+	Color *out = (Color *)mem, *tmp = out + n;
+	U32 *xs = (U32 *)(tmp + s->w + 1);
+	U8 *fx = (U8 *)(xs + n);
+	tmp[s->w] = 0;
+	blitcols(b, xs, fx);
+	I64 y0 = b->y0 + band*BLITBAND, y1 = MIN(y0 + BLITBAND, b->y1);
+	for (I64 y = y0; y < y1; y++) {
+		Color *d = &PIXEL(i, b->x0, y);
+		if (direct) {
+			blitrow(b, y, xs, fx, d, tmp);
+			continue;
+		}
+		blitrow(b, y, xs, fx, out, tmp);
+		if (frompm)
+			unpremulspan(out, n);
+		if (topm)
+			premulspan(out, n);
+		if (!(b->flags & BlitBlend))
+			__builtin_memcpy(d, out, n*sizeof(d[0]));
+		else if (i->mode == ImagePremul)
+			pmblendrow(d, out, n);
+		else if (i->mode == ImageSRGB)
+			for (I64 k = 0; k < n; k++)
+				d[k] = srgbblend(d[k], out[k]);
+		else
+			blendrow(d, out, n);
+	}
+}
+
+void drawimagescaled(Image *i, I16 x, I16 y, I16 w, I16 h, Image *s, U8 flags)
+{
+	if (w <= 0 || h <= 0 || !s->w || !s->h)
+		return;
+	/* NOTE: images don't fit into commands, they go right after what was recorded */
+	if (deferred(i))
+		drawsync();
+	I64 x0 = CLIPX(i, x), x1 = CLIPX(i, x + w), y0 = CLIPY(i, y), y1 = CLIPY(i, y + h);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+	OK bl = BOOL(flags & BlitBilinear);
+	Blit b = {
+		i, s, x, y, w, h, x0, x1, y0, y1,
+		blitorigin(x0 - x, s->w, w, bl), ((I64)s->w << 32)/w,
+		blitorigin(y0 - y, s->h, h, bl), ((I64)s->h << 32)/h,
+		flags, 0, 0,
+	};
+	if (b.du == (I64)1 << 32 && b.dv == (I64)1 << 32)
+		b.flags &= ~BlitBilinear;
+	adddamage(i, b.x0, b.y0, b.x1, b.y1);
+	/* NOTE: the bands blend pixel by pixel there */
+	if (i->mode == ImageSRGB)
+		srgbinit();
+	U64 nband = divceil(b.y1 - b.y0, BLITBAND), n = b.x1 - b.x0;
+	U64 size = (n + s->w + 1)*sizeof(Color) + n*sizeof(U32) + n;
+	/* NOTE: small blits aren't worth waking the workers up */
+	if (n*(b.y1 - b.y0) < 256*256) {
+		b.mem = memalloc(size);
+		for (U64 k = 0; k < nband; k++)
+			blitband(&b, k);
+	} else {
+		b.memstride = divceil(size, 16)*16;
+		b.mem = memalloc(nband*b.memstride);
+		parfor(nband, blitband, &b);
+	}
+	memfree(b.mem);
+}
+
+void drawimage(Image *i, I16 x, I16 y, Image *s, U8 flags)
+{
+	drawimagescaled(i, x, y, s->w, s->h, s, flags);
+}
+
+/* NOTE: like cover, but with the alpha of c scaled by the coverage */
+static void maskspan(Image *i, I64 y, I64 x0, U8 *m, I64 n, Color c)
+{
+	switch (i->mode) {
+	case ImagePremul:
+		pmblendspan(&PIXEL(i, x0, y), premul(c), m, n);
+		break;
+	case ImageSRGB:
+		srgbblendspan(&PIXEL(i, x0, y), c, m, n);
+		break;
+	default:
+		blendspan(&PIXEL(i, x0, y), c, m, n);
+	}
+}
+
+#define MASKRUN 8
+
+/* NOTE: 0 or 255 if the next MASKRUN coverages are all that, 1 otherwise */
+static U8 maskrun(U8 *m, I64 k, I64 n)
+{
+	U64 w;
+	if (k + MASKRUN > n)
+		return 1;
+	__builtin_memcpy(&w, m + k, MASKRUN);
+	return w == 0 ? 0 : w == ~(U64)0 ? 255 : 1;
+}
+
+/* NOTE: Rows are cut into runs at a word granularity: empty runs are skipped,
+ * opaque ones are filled and the rest go to the coverage kernels as a whole.
+ * Glyphs are mostly empty space and solid stems, so most pixels end up in
+ * the first two. */
+void drawmask(Image *i, I16 x, I16 y, ImageA8 *m, Color c)
+{
+	if (deferred(i))
+		drawsync();
+	I64 x0 = CLIPX(i, x), x1 = CLIPX(i, x + m->w);
+	I64 y0 = CLIPY(i, y), y1 = CLIPY(i, y + m->h);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+	adddamage(i, x0, y0, x1, y1);
+	I64 n = x1 - x0;
+	for (I64 py = y0; py < y1; py++) {
+		U8 *r = &PIXEL(m, x0 - x, py - y);
+		for (I64 k = 0, e; k < n; k = e) {
+			U8 t = maskrun(r, k, n);
+			if (t == 1) {
+				for (e = k + MASKRUN; e < n && maskrun(r, e, n) == 1; e += MASKRUN)
+					;
+				e = MIN(e, n);
+				maskspan(i, py, x0 + k, r + k, e - k, c);
+				continue;
+			}
+			for (e = k; e + MASKRUN <= n && maskrun(r, e, n) == t; e += MASKRUN)
+				;
+			for (; e < n && r[e] == t; e++)
+				;
+			if (t == 255)
+				span(i, py, x0 + k, x0 + e, c);
+		}
+	}
 }
@@ -1,11 +1,116 @@
+/* NOTE: vertex and edge positions of the rasterizers are fixed point */
+#define FIXBITS 8
+#define FIX (1 << FIXBITS)
+
 void drawclear(Image *i, Color c);
 void drawtriangle(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c);
 void drawsmoothtriangle(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c);
 void drawring(Image *i, I16 xc, I16 yc, I16 r, Color c);
 void drawcircle(Image *i, I16 xc, I16 yc, I16 r, Color c);
 void drawsmoothcircle(Image *i, I16 xc, I16 yc, I16 r, Color c);
+/* NOTE: same as drawsmoothcircle, but the center is fixed point */
+void drawsmoothdot(Image *i, I64 xc, I64 yc, I16 r, Color c);
 void drawbezier(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3, Color c);
 void drawrect(Image *i, I16 xtl, I16 ytl, I16 w, I16 h, Color c);
 void drawline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, Color c);
+/* NOTE: joins n points with lines, every shared point is painted once */
+void drawpolyline(Image *i, I16 (*p)[2], I64 n, Color c);
 void drawthickline(Image *i, I16 x1, I16 y1, I16 x2, I16 y2, U8 w, Color c);
 void drawpixel(Image *i, I16 x, I16 y, Color c);
+
+/* NOTE: while an image is deferred, the functions above only record
+ * commands, which are then rasterized by tiles in parallel on sync */
+void drawdefer(Image *i);
+void drawsync(void);
+
+/* NOTE: Damage tracking: while an image is tracked, every draw call into it
+ * or into its subimages adds its bounds to a few merged dirty rects, which
+ * drawdamage hands out and forgets. If there are more than n of them, the
+ * last one covers the rest. Code writing pixels by hand calls adddamage. */
+typedef struct {
+	I16 x0, y0, x1, y1;
+} Rect;
+
+void trackdamage(Image *i, OK on);
+void adddamage(Image *i, I64 x0, I64 y0, I64 x1, I64 y1);
+I64  drawdamage(Image *i, Rect *r, I64 n);
+
+/* NOTE: Batched primitives as a struct-of-arrays: (x, y) are the centers,
+ * the top-left corners or the first endpoints, and (u, v) are the radii
+ * (v is unused and may be 0), the sizes or the second endpoints (v is required,
+ * nothing is drawn without it). If c is 0, every primitive is drawn with color.
+ * Big batches are binned by tiles like deferred drawing, which syncs the image
+ * that was deferred before, if it isn't i. */
+typedef struct {
+	I64   n;
+	I16   *x, *y, *u, *v;
+	Color *c;
+	Color color;
+} Prims;
+
+void drawcircles(Image *i, Prims *p);
+void drawsmoothcircles(Image *i, Prims *p);
+void drawrects(Image *i, Prims *p);
+void drawlines(Image *i, Prims *p);
+
+typedef enum {
+	SegLine,
+	SegQuad,
+} Segtype;
+
+typedef struct {
+	I16 x[3], y[3];
+	U8  type;
+} Segment;
+
+typedef enum {
+	FillNonzero,
+	FillEvenodd,
+} Fillrule;
+
+/* NOTE: fills closed contours of lines and quadratic curves with the exact
+ * area coverage of every pixel, the cost follows the number of edge crossings */
+void drawpath(Image *i, Segment *s, I64 n, U8 rule, Color c);
+
+/* NOTE: fills the 4-connected region around (x, y) whose channels selected
+ * by mask are within tol of the seed pixel's ones */
+void drawfill(Image *i, I16 x, I16 y, U8 tol, Color mask, Color c);
+
+/* NOTE: s gets copied (or blended with its own alpha) into the rect,
+ * pixels are picked by nearest neighbour unless BlitBilinear is set */
+enum {
+	BlitBlend    = 1 << 0,
+	BlitBilinear = 1 << 1,
+};
+
+void drawimage(Image *i, I16 x, I16 y, Image *s, U8 flags);
+void drawimagescaled(Image *i, I16 x, I16 y, I16 w, I16 h, Image *s, U8 flags);
+
+/* NOTE: blends c through the coverage of m, placed at (x, y) */
+void drawmask(Image *i, I16 x, I16 y, ImageA8 *m, Color c);
+
+/* NOTE: Signed area accumulator behind drawpath and the glyph rasterizer.
+ * Every edge adds cells, and the running sum of the cells of a row, from
+ * left to right, is the coverage (clipped on the left side, it ends up in x = 0). */
+typedef struct {
+	U32 k; /* y << 16 | x */
+	F32 a;
+} Cell;
+
+#define CELLX(c) ((c).k & 0xFFFF)
+#define CELLY(c) ((c).k >> 16)
+
+typedef struct {
+	Cell *c;
+	I64  n, cap;
+	I64  w, h;
+} Cells;
+
+void cellline(Cells *c, F64 x1, F64 y1, F64 x2, F64 y2);
+void cellquad(Cells *c, F64 x1, F64 y1, F64 x2, F64 y2, F64 x3, F64 y3);
+
+/* NOTE: half-space core of the triangle rasterizers: vertices are fixed point,
+ * pixels are sampled at their centers and f gets called with the covered part
+ * [x0, x1) of every row, clipped to i */
+typedef void Spanfn(void *ctx, I64 y, I64 x0, I64 x1);
+void trianglespans(Image *i, I64 x1, I64 y1, I64 x2, I64 y2, I64 x3, I64 y3, Spanfn *f, void *ctx);
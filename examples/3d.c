@@ -1,6 +1,7 @@
 #include "types.h"
 #include "color.h"
 #include "image.h"
+#include "draw.h"
 #include "win.h"
 #include "math.h"
 #include "la.h"
@@ -196,37 +197,47 @@ Vec project(Camera c, Image *f, Vec p)
 	return toscreen((Vec){p.x*c.d/p.z, p.y*c.d/p.z, 1/p.z}, c, f);
 }
 
-void drawtriangle3d(Image *i, Image *zb, Vec p1, Vec p2, Vec p3, Color c)
+typedef struct {
+	Image *i;
+	ImageF32 *zb;
+	F64 z, zx, zy;
+	Color c;
+} Span3d;
+
+void span3d(void *ctx, I64 y, I64 x0, I64 x1)
 {
-	I64 xmin = CLIPX(i, fceil(MIN3(p1.x, p2.x, p3.x)));
-	I64 xmax = CLIPX(i, ffloor(MAX3(p1.x, p2.x, p3.x))+1);
-	I64 ymin = CLIPY(i, fceil(MIN3(p1.y, p2.y, p3.y)));
-	I64 ymax = CLIPY(i, ffloor(MAX3(p1.y, p2.y, p3.y))+1);
-	if ((p3.y - p1.y)*(p2.x - p1.x) - (p3.x - p1.x)*(p2.y - p1.y) < 0)
-		SWAP(p2, p3);
-	F64 os = (p1.x - p3.x)*(p2.y - p3.y) - (p2.x - p3.x)*(p1.y - p3.y);
-	if (!os)
-		return;
-	F64 o1 = (ymin - p1.y)*(p2.x - p1.x) - (xmin - p1.x)*(p2.y - p1.y);
-	F64 o2 = (ymin - p2.y)*(p3.x - p2.x) - (xmin - p2.x)*(p3.y - p2.y);
-	F64 o3 = (ymin - p3.y)*(p1.x - p3.x) - (xmin - p3.x)*(p1.y - p3.y);
-	for (I64 y = ymin; y < ymax; y++) {
-		for (I64 x = xmin; x < xmax; x++) {
-			F64 z = (o2*p1.z + o3*p2.z + o1*p3.z)/os;
-			if (o1 >= 0 && o2 >= 0 && o3 >= 0 && z > *(F32 *)&PIXEL(zb, x, y)) {
-				*(F32 *)&PIXEL(zb, x, y) = z;
-				PIXEL(i, x, y) = blend(PIXEL(i, x, y), c);
-			}
-			o1 -= p2.y - p1.y; o2 -= p3.y - p2.y; o3 -= p1.y - p3.y;
+	Span3d *s = ctx;
+	F64 z = s->z + s->zx*(x0 + .5) + s->zy*(y + .5);
+	for (I64 x = x0; x < x1; x++, z += s->zx) {
+		if (z > PIXEL(s->zb, x, y)) {
+			PIXEL(s->zb, x, y) = z;
+			PIXEL(s->i, x, y) = blend(PIXEL(s->i, x, y), s->c);
 		}
-		o1 += (p2.y - p1.y)*(xmax - xmin) + (p2.x - p1.x);
-		o2 += (p3.y - p2.y)*(xmax - xmin) + (p3.x - p2.x);
-		o3 += (p1.y - p3.y)*(xmax - xmin) + (p1.x - p3.x);
 	}
 }
 
+/* NOTE: clamped, so that the edge functions can't overflow */
+I64 tofix(F64 v)
+{
+	return CLAMP(v, -(1 << 21), 1 << 21)*FIX;
+}
+
+void drawtriangle3d(Image *i, ImageF32 *zb, Vec p1, Vec p2, Vec p3, Color c)
+{
+	F64 d = (p2.x - p1.x)*(p3.y - p1.y) - (p3.x - p1.x)*(p2.y - p1.y);
+	if (!d)
+		return;
+	/* NOTE: 1/z is a linear function of the screen coordinates (see project) */
+	Span3d s = {i, zb, 0, 0, 0, c};
+	s.zx = ((p2.z - p1.z)*(p3.y - p1.y) - (p3.z - p1.z)*(p2.y - p1.y))/d;
+	s.zy = ((p3.z - p1.z)*(p2.x - p1.x) - (p2.z - p1.z)*(p3.x - p1.x))/d;
+	s.z = p1.z - s.zx*p1.x - s.zy*p1.y;
+	trianglespans(i, tofix(p1.x), tofix(p1.y), tofix(p2.x), tofix(p2.y),
+		tofix(p3.x), tofix(p3.y), span3d, &s);
+}
+
 /* TODO: figure out how to rasterize spheres with depth buffering and clipping */
-void rasterize(Image *f, Image *z, Camera c)
+void rasterize(Image *f, ImageF32 *z, Camera c)
 {
 	/* NOTE: for orthogonal matrices transposition is inversion */
 	Mat inv = transp(c.rot);
@@ -289,8 +300,8 @@ void rasterize(Image *f, Image *z, Camera c)
 #define WIDTH  600
 #define HEIGHT 600
 
-Image fbuf = {WIDTH, HEIGHT, WIDTH, (Color[WIDTH*HEIGHT]){}};
-Image zbuf = {WIDTH, HEIGHT, WIDTH, (Color[WIDTH*HEIGHT]){}};
+Image fbuf = {.w = WIDTH, .h = HEIGHT, .s = WIDTH, .p = (Color[WIDTH*HEIGHT]){}};
+ImageF32 zbuf = {.w = WIDTH, .h = HEIGHT, .s = WIDTH, .p = (F32[WIDTH*HEIGHT]){}};
 
 int main(int, char **argv)
 {
@@ -332,9 +343,7 @@ int main(int, char **argv)
 			raytrace(&fbuf, c);
 		else
 			rasterize(&fbuf, &zbuf, c);
-		for (U16 y = 0; y < f->h; y++)
-		for (U16 x = 0; x < f->w; x++)
-			PIXEL(f, x, y) = PIXEL(&fbuf, x*WIDTH/f->w, y*HEIGHT/f->h);
+		drawimagescaled(f, 0, 0, f->w, f->h, &fbuf, 0);
 	}
 	winclose();
 	return 0;
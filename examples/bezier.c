@@ -65,8 +65,10 @@ int main(void)
 		for (Bezier2 *c = head; c; c = c->next) {
 			for (int i = 0; i < 3; i++)
 				updatepoint(fb, c->pt[i]);
+			I16 poly[3][2];
 			for (int i = 0; i < 3; i++)
-				drawline(fb, c->pt[i][0], c->pt[i][1], c->pt[1][0], c->pt[1][1], RGBA(40, 40, 40, 255));
+				poly[i][0] = c->pt[i][0], poly[i][1] = c->pt[i][1];
+			drawpolyline(fb, poly, 3, RGBA(40, 40, 40, 255));
 			for (int i = 0; i < 3; i++)
 				drawsmoothcircle(fb, c->pt[i][0], c->pt[i][1], 6, WHITE);
 			drawbezier(fb, c->pt[0][0], c->pt[0][1], c->pt[1][0], c->pt[1][1], c->pt[2][0], c->pt[2][1], WHITE);
@@ -72,7 +72,7 @@ int main(int, char **argv)
 		}
 		drawclear(f, BGCOLOR);
 		for (int i = 0; i < N; i++)
-			drawsmoothcircle(f, c[i][0], c[i][1], r[i], col[i]);
+			drawsmoothdot(f, c[i][0]*FIX, c[i][1]*FIX, r[i], col[i]);
 	}
 	winclose();
 	return 0;
@@ -2,6 +2,7 @@
 #include "alloc.h"
 #include "color.h"
 #include "image.h"
+#include "io.h"
 #include "imagefmt.h"
 #include "win.h"
 #include "draw.h"
@@ -9,6 +10,7 @@
 #define LINECOLOR RGBA(240, 240, 240, 255)
 #define BGCOLOR RGBA(18, 18, 18, 255)
 #define FILLCOLOR RGBA(30, 30, 30, 255)
+#define FILLMASK RGBA(255, 255, 255, 0) /* NOTE: blending leaves the alpha at 0 */
 
 typedef struct Point Point;
 
@@ -43,14 +45,15 @@ Curve *curve(Curve *next)
 
 typedef Curve *Picture;
 
-void addpoint(Picture *p, int x, int y)
+OK addpoint(Picture *p, int x, int y)
 {
 	if (!*p)
 		*p = curve(*p);
 	Point *pt = (*p)->last;
 	if (pt && pt->x == x && pt->y == y)
-		return;
+		return 0;
 	(*p)->last = point(x, y, pt);
+	return 1;
 }
 
 void undocurve(Picture *p)
@@ -97,51 +100,55 @@ void drawcurves(Image *f, Picture p)
 	}
 }
 
-void drawfill(Image *f, I16 x, I16 y, Color c)
+void endcurve(Picture *p)
 {
-	if (x < 0 || x >= f->w || y < 0 || y >= f->h)
+	if (!*p || !(*p)->last)
 		return;
-	Color fc = PIXEL(f, x, y);
-	I16 xl = x, xr = x + 1;
-	for (; xl >= 0 && PIXEL(f, xl, y) == fc; xl--)
-		PIXEL(f, xl, y) = c;
-	for (; xr < f->w && PIXEL(f, xr, y) == fc; xr++)
-		PIXEL(f, xr, y) = c;
-	for (I16 xc = xl + 1; xc < xr; xc++) {
-		if (y > 0 && PIXEL(f, xc, y-1) == fc)
-			drawfill(f, xc, y-1, c);
-		if (y < f->h - 1 && PIXEL(f, xc, y+1) == fc)
-			drawfill(f, xc, y+1, c);
-	}
+	*p = curve(*p);
 }
 
-void endcurve(Picture *p)
+void drawlast(Image *f, Picture p)
 {
-	if (!*p || !(*p)->last)
+	Point *p1 = p ? p->last : 0;
+	if (!p1)
 		return;
-	*p = curve(*p);
+	Point *p2 = p1->next ? p1->next : p1;
+	drawline(f, p1->x, p1->y, p2->x, p2->y, LINECOLOR);
 }
 
+/* NOTE: the picture is redrawn from scratch only when something goes away,
+ * otherwise just the newest segment is drawn and flushed */
 int main(void)
 {
 	Picture p = {0};
+	Color *prev = 0;
+	OK filled = 0;
 	winopen(640, 480, "paint", 0);
+	partialflush(1);
 	for (;;) {
 		Image *f = frame();
+		OK redraw = f->p != prev || filled;
+		prev = f->p;
 		if (keywaspressed('q'))
 			break;
-		if (keyisdown('u'))
-			undopoint(&p);
-		if (keywaspressed('y'))
-			undocurve(&p);
+		if (keyisdown('u') && p)
+			undopoint(&p), redraw = 1;
+		if (keywaspressed('y') && p)
+			undocurve(&p), redraw = 1;
+		OK added = 0;
 		if (btnisdown(1))
-			addpoint(&p, mousex(), mousey());
+			added = addpoint(&p, mousex(), mousey());
 		else
 			endcurve(&p);
-		drawclear(f, BGCOLOR);
-		drawcurves(f, p);
-		if (btnisdown(3))
-			drawfill(f, mousex(), mousey(), FILLCOLOR);
+		filled = btnisdown(3);
+		if (redraw || filled) {
+			drawclear(f, BGCOLOR);
+			drawcurves(f, p);
+		} else if (added) {
+			drawlast(f, p);
+		}
+		if (filled)
+			drawfill(f, mousex(), mousey(), 0, FILLMASK, FILLCOLOR);
 		if (keywaspressed('s'))
 			image2ppm(f, "out.ppm");
 	}
@@ -21,6 +21,20 @@ I16 tickstep(F64 scale)
 #define BGCOLOR RGBA(18, 18, 18, 255)
 #define LINECOLOR RGBA(120, 120, 120, 255)
 
+#define MAXPRIMS 1024
+
+I16 px[MAXPRIMS], py[MAXPRIMS], pu[MAXPRIMS], pv[MAXPRIMS];
+
+void addprim(Prims *p, I16 x, I16 y, I16 u, I16 v)
+{
+	if (p->n == MAXPRIMS)
+		return;
+	p->x[p->n] = x, p->y[p->n] = y, p->u[p->n] = u;
+	if (p->v)
+		p->v[p->n] = v;
+	p->n += 1;
+}
+
 int main(int, char **argv)
 {
 	Poly p = {{-0.2, 5, -10, -3, 2}, 4};
@@ -41,24 +55,28 @@ int main(int, char **argv)
 		drawclear(f, BGCOLOR);
 		drawline(f, 0, f->h/2, f->w, f->h/2, LINECOLOR);
 		drawsmoothtriangle(f, f->w, f->h/2, f->w-10, f->h/2-5, f->w-10, f->h/2+5, LINECOLOR);
+		Prims ticks = {0, px, py, pu, pv, 0, LINECOLOR};
 		for (I16 i = f->w/2 + xstep; i < f->w; i += xstep) {
-			drawline(f, i, f->h/2-5, i, f->h/2 + 5, LINECOLOR);
-			drawline(f, f->w-i, f->h/2-5, f->w-i, f->h/2 + 5, LINECOLOR);
+			addprim(&ticks, i, f->h/2-5, i, f->h/2 + 5);
+			addprim(&ticks, f->w-i, f->h/2-5, f->w-i, f->h/2 + 5);
 		}
 		drawline(f, f->w/2, 0, f->w/2, f->h, LINECOLOR);
 		drawsmoothtriangle(f, f->w/2, 0, f->w/2-5, 10, f->w/2+5, 10, LINECOLOR);
 		for (I16 i = f->h/2 + ystep; i < f->h; i += ystep) {
-			drawline(f, f->w/2-5, i, f->w/2 + 5, i, LINECOLOR);
-			drawline(f, f->w/2-5, f->h-i, f->w/2 + 5, f->h-i, LINECOLOR);
+			addprim(&ticks, f->w/2-5, i, f->w/2 + 5, i);
+			addprim(&ticks, f->w/2-5, f->h-i, f->w/2 + 5, f->h-i);
 		}
+		drawlines(f, &ticks);
 		drawsmoothcircle(f, f->w/2, f->h/2, 5, LINECOLOR);
+		Prims dots = {0, px, py, pu, 0, 0, RGBA(100, 100, 150, 100)};
 		for (U16 i = 0; i < f->w; i += 5) {
 			F64 x = (i - f->w/2)*xscale;
 			F64 y = eval(p, x);
 			F64 j = f->h/2 - y*yscale;
 			if (j >= 0 && j <= f->h)
-				drawsmoothcircle(f, i, j, 5, RGBA(100, 100, 150, 100));
+				addprim(&dots, i, j, 5, 0);
 		}
+		drawsmoothcircles(f, &dots);
 		for (U8 i = 0; i < r.n; i++)
 			drawsmoothcircle(f, r.v[i]/xscale + f->w/2, f->h/2, 5, RED);
 	}
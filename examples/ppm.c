@@ -3,17 +3,10 @@
 #include "color.h"
 #include "alloc.h"
 #include "image.h"
+#include "io.h"
 #include "imagefmt.h"
 #include "draw.h"
 #include "win.h"
-#include "io.h"
-
-void drawimage(Image *i, I32 xp, I32 yp, Image *s)
-{
-	for (U16 x = CLIPX(i, xp); x < CLIPX(i, xp+s->w); x++)
-	for (U16 y = CLIPY(i, yp); y < CLIPY(i, yp+s->h); y++)
-		PIXEL(i, x, y) = PIXEL(s, x - xp, y - yp);
-}
 
 int main(int argc, char **argv)
 {
@@ -31,7 +24,7 @@ int main(int argc, char **argv)
 	while (!keyisdown('q')) {
 		Image *f = frame();
 		drawclear(f, BLACK);
-		drawimage(f, mousex() - i.w/2, mousey() - i.h/2, &i);
+		drawimage(f, mousex() - i.w/2, mousey() - i.h/2, &i, 0);
 	}
 	arfree(&mem);
 	winclose();
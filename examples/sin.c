@@ -14,13 +14,15 @@ int main(int, char **argv)
 	while (!keyisdown('q')) {
 		Image *fb = frame();
 		t += lastframetime()/1e9;
+		drawdefer(fb);
 		drawclear(fb, BGCOLOR);
 		for (int i = 0; i < 200; i++) {
-			drawsmoothcircle(fb, fb->w*i/200, fb->h/2 + fsin(t)*fsin(t + 4*PI*i/200)*fb->h/2, 5, RGBA(110, 70, 70, 255));
-			drawsmoothcircle(fb, fb->w*i/200, fb->h/2 + fcos(t)*fcos(t*.8 + 4*PI*i/200)*fb->h/2, 5, RGBA(70, 110, 70, 255));
-			drawsmoothcircle(fb, fb->w*i/200, fb->h/2 + fsin(t)*fsin(t*.6 + 4*PI*i/200 + PI)*fb->h/2, 5, RGBA(70, 70, 110, 255));
-			drawsmoothcircle(fb, fb->w*i/200, fb->h/2 + fcos(t)*fsin(t*.4 + 4*PI*i/200 + 3*PI/2)*fb->h/2, 5, RGBA(110, 110, 110, 255));
+			drawsmoothdot(fb, fb->w*i/200*FIX, (fb->h/2 + fsin(t)*fsin(t + 4*PI*i/200)*fb->h/2)*FIX, 5, RGBA(110, 70, 70, 255));
+			drawsmoothdot(fb, fb->w*i/200*FIX, (fb->h/2 + fcos(t)*fcos(t*.8 + 4*PI*i/200)*fb->h/2)*FIX, 5, RGBA(70, 110, 70, 255));
+			drawsmoothdot(fb, fb->w*i/200*FIX, (fb->h/2 + fsin(t)*fsin(t*.6 + 4*PI*i/200 + PI)*fb->h/2)*FIX, 5, RGBA(70, 70, 110, 255));
+			drawsmoothdot(fb, fb->w*i/200*FIX, (fb->h/2 + fcos(t)*fsin(t*.4 + 4*PI*i/200 + 3*PI/2)*fb->h/2)*FIX, 5, RGBA(110, 110, 110, 255));
 		}
+		drawdefer(0);
 	}
 	winclose();
 	return 0;
@@ -3,6 +3,7 @@
 #include "image.h"
 #include "win.h"
 #include "draw.h"
+#include "layer.h"
 
 #define PROFENABLED
 #include "prof.h"
@@ -54,38 +55,54 @@ void drawgradients(Image *i, int dx, int dy)
 {
 	for (int x = 0; x < i->w; x++)
 	for (int y = 0; y < i->h; y++)
-		PIXEL(i, x, y) = RGBA(0, (U8)(x-dx), (U8)(y-dy), 0);
+		PIXEL(i, x, y) = RGBA(0, (U8)(x-dx), (U8)(y-dy), 255);
 }
 
 int main(void)
 {
 	int dx = 0, dy = 0;
+	Layers s = {0};
 	winopen(600, 600, "Example", 60);
 	for (;;) {
 		profbegin("frame preparation");
 		Image *f = frame();
-		Image l = subimage(*f, 0, 0, f->w/2, f->h);
-		Image r = subimage(*f, f->w/2, 0, f->w - f->w/2, f->h);
+		if (!s.n || s.l[0].i.w != f->w || s.l[0].i.h != f->h) {
+			freelayers(&s);
+			s = newlayers(2, f->w, f->h);
+		}
 		int mx = mousex(), my = mousey();
 		profend();
 
 		profbegin("drawing");
-		drawgradients(&l, dy, dx);
-		drawshapes(&r, dx, dy);
-		drawrect(f, mx, my, 50, 50, RGBA(0, 0, 255, 100));
-		drawrect(f, mx, my, -50, -50, RGBA(200, 200, 0, 100));
-		drawrect(f, mx, my, 50, -50, RGBA(255, 0, 0, 100));
-		drawrect(f, mx, my, -50, 50, RGBA(255, 0, 255, 100));
+		/* NOTE: the scene only changes when it moves, the overlay every frame */
+		Image *bg = &s.l[0].i, *fg = &s.l[1].i;
+		if (s.l[0].dirty) {
+			Image l = subimage(*bg, 0, 0, bg->w/2, bg->h);
+			Image r = subimage(*bg, bg->w/2, 0, bg->w - bg->w/2, bg->h);
+			drawgradients(&l, dy, dx);
+			drawshapes(&r, dx, dy);
+		}
+		drawclear(fg, 0);
+		drawrect(fg, mx, my, 50, 50, RGBA(0, 0, 255, 100));
+		drawrect(fg, mx, my, -50, -50, RGBA(200, 200, 0, 100));
+		drawrect(fg, mx, my, 50, -50, RGBA(255, 0, 0, 100));
+		drawrect(fg, mx, my, -50, 50, RGBA(255, 0, 255, 100));
+		s.l[1].dirty = 1;
+		flatten(&s, f);
 		profend();
 
+		int ox = dx, oy = dy;
 		if (keyisdown('q')) break;
 		if (keyisdown('d')) dx -= 4;
 		if (keyisdown('a')) dx += 4;
 		if (keyisdown('s')) dy -= 4;
 		if (keyisdown('w')) dy += 4;
+		if (dx != ox || dy != oy)
+			s.l[0].dirty = 1;
 
 		profdump();
 	}
+	freelayers(&s);
 	winclose();
 	return 0;
 }
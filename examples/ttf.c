@@ -33,14 +33,15 @@ OK utf8(char **s, U32 *c)
 /* TODO: maybe the font cache should take a fixed size arena */
 /* NOTE: this is a basic LRU cache */
 typedef struct {
-	Font    fn;
-	Arena   mem;
-	F64     px, scale;
-	I64     xoff, yoff;
-	Image   bmp[CACHESIZE];
-	Glyph   *map[CACHESIZE];
-	U16     next[CACHESIZE];
-	U16     n, last;
+	Font     fn;
+	Arena    mem;
+	F64      px, scale;
+	I64      xoff, yoff;
+	ImageF32 bmp; /* NOTE: coverage of the glyph being rasterized */
+	ImageA8  mask[CACHESIZE];
+	Glyph    *map[CACHESIZE];
+	U16      next[CACHESIZE];
+	U16      n, last;
 } GCache;
 
 void setpx(GCache *c, F64 px)
@@ -54,15 +55,12 @@ void setpx(GCache *c, F64 px)
 	c->xoff = -xmin;
 	c->yoff = ymax;
 	U64 w = xmax - xmin, h = ymax - ymin;
-	for (I i = 0; i < CACHESIZE; i++) {
-		c->bmp[i].w = w;
-		c->bmp[i].s = w;
-		c->bmp[i].h = h;
-		c->bmp[i].p = aralloc(&c->mem, w*h * sizeof(Color));
-	}
+	c->bmp = (ImageF32){w, h, w, aralloc(&c->mem, w*h * sizeof(F32))};
+	for (I i = 0; i < CACHESIZE; i++)
+		c->mask[i] = (ImageA8){w, h, w, aralloc(&c->mem, w*h)};
 }
 
-Image *lookup(GCache *c, Glyph *g)
+ImageA8 *lookup(GCache *c, Glyph *g)
 {
 	U16 *pp = &c->last;
 	OK found = 0;
@@ -83,29 +81,20 @@ Image *lookup(GCache *c, Glyph *g)
 		c->next[p] = c->last;
 		c->last = p;
 	}
-	Image *b = &c->bmp[c->last];
+	ImageA8 *m = &c->mask[c->last];
 	if (!found) {
 		c->map[c->last] = g;
-		drawbmpaa(b, c->xoff, c->yoff, *g, c->scale);
-	}
-	return b;
-}
-
-void drawgbitmap(Image *f, I16 x0, I16 y0, Image *b, Color c)
-{
-	for (I16 y = CLIPY(f, y0); y < CLIPY(f, y0 + b->h); y++)
-	for (I16 x = CLIPX(f, x0); x < CLIPX(f, x0 + b->w); x++) {
-		U8 a = *(F32 *)&PIXEL(b, x - x0, y - y0) * 255.0;
-		PIXEL(f, x, y) = blend(PIXEL(f, x, y), RGBA(R(c), G(c), B(c), a));
+		drawbmpaa(&c->bmp, c->xoff, c->yoff, *g, c->scale);
+		f32toa8(m, &c->bmp, 0, 1);
 	}
+	return m;
 }
 
 I16 drawchar(Image *f, I16 x, I16 y, GCache *gc, U64 code, Color c)
 {
 	U16 idx = findglyph(gc->fn, code);
 	Glyph *g = &gc->fn.glyphs[idx];
-	Image *b = lookup(gc, g);
-	drawgbitmap(f, x - gc->xoff, y - gc->yoff, b, c);
+	drawmask(f, x - gc->xoff, y - gc->yoff, lookup(gc, g), c);
 	return g->advance * gc->scale;
 }
 
@@ -164,6 +153,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	GCache c = {.fn = fn};
+	OK gamma = 1;
 	setpx(&c, 20);
 	winopen(1920, 1080, argv[0], 0);
 	while (!keyisdown('q')) {
@@ -172,6 +162,9 @@ int main(int argc, char **argv)
 			setpx(&c, c.px * 1.1);
 		if (btnwaspressed(5))
 			setpx(&c, c.px / 1.1);
+		if (keywaspressed('g'))
+			gamma = !gamma;
+		f->mode = gamma ? ImageSRGB : ImageStraight;
 		drawclear(f, RGBA(18, 18, 18, 255));
 		U32 l = textwidth(argv[2], &c);
 		drawtext(f, mousex() - l/2, mousey(), &c, argv[2], RGBA(255, 255, 255, 200));
@@ -1,6 +1,7 @@
 #include "types.h"
 #include "color.h"
 #include "image.h"
+#include "alloc.h"
 #include "draw.h"
 #include "poly.h"
 #include "math.h"
@@ -127,9 +128,20 @@ static Hit isectcurve(I16 ry, I16 x1, I16 y1, I16 x2, I16 y2, I16 x3, I16 y3)
 	return h;
 }
 
-void drawbmp(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
+static void clearf32(ImageF32 *f)
 {
-	drawclear(f, 0);
+	for (I16 y = 0; y < f->h; y++)
+	for (I16 x = 0; x < f->w; x++)
+		PIXEL(f, x, y) = 0;
+}
+
+/* NOTE: the winding count changes are summed modulo 256 in the pixels,
+ * which is exact as long as the count itself stays within an I8 */
+void drawbmp(ImageA8 *f, I16 x0, I16 y0, Glyph g, F64 scale)
+{
+	for (I16 y = 0; y < f->h; y++)
+	for (I16 x = 0; x < f->w; x++)
+		PIXEL(f, x, y) = 0;
 	if (!g.nseg)
 		return;
 	for (U16 i = 0; i < g.nseg; i++) {
@@ -154,90 +166,18 @@ void drawbmp(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
 	for (I16 y = 0; y < f->h; y++) {
 		I32 wn = 0;
 		for (I16 x = 0; x < f->w; x++) {
-			wn += PIXEL(f, x, y);
-			PIXEL(f, x, y) = BOOL(wn);
-		}
-	}
-}
-
-static F64 step(F64 v, F64 lim, F64 dir)
-{
-	return dir*MIN(ffloor(dir*v + 1), dir*lim);
-}
-
-static F64 adv(F64 v, F64 a, F64 lim, F64 dir)
-{
-	return dir*MIN(dir*(v + a), dir*lim);
-}
-
-/*
- * The idea of this approach is to use pixel coverage as opacity.
- * To find the coverage values we incrementally build the signed area
- * difference array.
- *
- *          i                  i+1
- * .------------------.------------------.
- * |        (x, y)    |                  |
- * |__________,_______|__________________|  Each line segment contained within one pixel
- * |         /        |                  |  adds Sr to the containing pixel (i) and (yn - y)
- * |        /         |                  |  to all the pixels to the right of it.
- * |  Sl   /    Sr    |                  |  Since (yn - y) = Sr + Sl, we should simply
- * |      /           |                  |  add Sr and Sl to i-th and i+1-st pixel's array
- * |_____/____________|__________________|  values respectively.
- * |  (xn, yn)        |                  |
- * '------------------'------------------'
- */
-static void putline(Image *i, F64 x1, F64 y1, F64 x2, F64 y2)
-{
-	if (y1 == y2)
-		return;
-	F64 dx = x2 - x1, sx = SIGN(dx);
-	F64 dy = y2 - y1, sy = SIGN(dy);
-	for (F64 x = x1, y = y1; y != y2;) {
-		F64 xn = step(x, x2, sx), xd = xn - x;
-		F64 yn = step(y, y2, sy), yd = yn - y;
-		if (dx) {
-			if (xd && fabs(dy*xd) < fabs(yd*dx))
-				yn = adv(y, dy/dx*xd, yn, sy);
-			else
-				xn = adv(x, dx/dy*yd, xn, sx);
-		} else {
-			xn = x;
-		}
-		F64 xm = (x + xn)/2, ym = (y + yn)/2;
-		I16 px = ffloor(xm), py = ffloor(ym);
-		F64 d = yn - y, f = xm - px;
-		if (py >= 0 && py < i->h) {
-			if (px < i->w)
-				*(F32 *)&PIXEL(i, MAX(px, 0),   py) += d*(1 - f);
-			if (px < i->w-1)
-				*(F32 *)&PIXEL(i, MAX(px+1, 0), py) += d*f;
+			wn += (I8)PIXEL(f, x, y);
+			PIXEL(f, x, y) = wn ? 255 : 0;
 		}
-		x = xn, y = yn;
-	}
-}
-
-static void putquad(Image *f, F64 x1, F64 y1, F64 x2, F64 y2, F64 x3, F64 y3)
-{
-	F64 l2  = (x3 - x1)*(x3 - x1) + (y3 - y1)*(y3 - y1);
-	F64 dot = (x2 - x1)*(y3 - y1) - (y2 - y1)*(x3 - x1);
-	if (dot*dot <= .25*l2) {
-		/* control is less than half pixel away */
-		putline(f, x1, y1, x3, y3);
-		return;
 	}
-	F64 lx = (x1 + x2)/2, ly = (y1 + y2)/2;
-	F64 rx = (x2 + x3)/2, ry = (y2 + y3)/2;
-	F64 mx = (lx + rx)/2, my = (ly + ry)/2;
-	putquad(f, x1, y1, lx, ly, mx, my);
-	putquad(f, mx, my, rx, ry, x3, y3);
 }
 
-void drawbmpaa(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
+void drawbmpaa(ImageF32 *f, I16 x0, I16 y0, Glyph g, F64 scale)
 {
-	drawclear(f, 0);
+	clearf32(f);
 	if (!g.nseg)
 		return;
+	Cells c = {0, 0, 0, f->w, f->h};
 	for (U16 i = 0; i < g.nseg; i++) {
 		Segment s = g.segs[i];
 		F64 x[3], y[3];
@@ -246,15 +186,18 @@ void drawbmpaa(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
 			y[j] = y0 - s.y[j]*scale;
 		}
 		if (s.type == SegLine)
-			putline(f, x[0], y[0], x[1], y[1]);
+			cellline(&c, x[0], y[0], x[1], y[1]);
 		else
-			putquad(f, x[0], y[0], x[1], y[1], x[2], y[2]);
+			cellquad(&c, x[0], y[0], x[1], y[1], x[2], y[2]);
 	}
+	for (I64 k = 0; k < c.n; k++)
+		PIXEL(f, CELLX(c.c[k]), CELLY(c.c[k])) += c.c[k].a;
+	memfree(c.c);
 	for (I16 y = 0; y < f->h; y++) {
 		F64 a = 0;
 		for (I16 x = 0; x < f->w; x++) {
-			a += *(F32 *)&PIXEL(f, x, y);
-			*(F32 *)&PIXEL(f, x, y) = MIN(fabs(a), 1);
+			a += PIXEL(f, x, y);
+			PIXEL(f, x, y) = MIN(fabs(a), 1);
 		}
 	}
 }
@@ -305,11 +248,13 @@ static F64 distcurve(F64 x, F64 y, F64 x1, F64 y1, F64 x2, F64 y2, F64 x3, F64 y
 	return d;
 }
 
-void drawsdf(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
+void drawsdf(ImageF32 *f, I16 x0, I16 y0, Glyph g, F64 scale)
 {
-	drawbmp(f, x0, y0, g, scale); /* calculate signs */
+	clearf32(f);
 	if (!g.nseg)
 		return;
+	ImageA8 in = newimagea8(f->w, f->h);
+	drawbmp(&in, x0, y0, g, scale); /* calculate signs */
 	for (I16 y = 0; y < f->h; y++)
 	for (I16 x = 0; x < f->w; x++) {
 		F64 d = INF;
@@ -320,13 +265,14 @@ void drawsdf(Image *f, I16 x0, I16 y0, Glyph g, F64 scale)
 			else
 				d = MIN(d, distline(x, y, s.x[0], s.y[0], s.x[1], s.y[1]));
 		}
-		*(F32 *)&PIXEL(f, x, y) = fsetsign(d, PIXEL(f, x, y));
+		PIXEL(f, x, y) = fsetsign(d, PIXEL(&in, x, y));
 	}
+	memfree(in.p);
 	/* NOTE: this code is for debugging */
 	/*
 	 * for (I16 y = 0; y < f->h; y++)
 	 * for (I16 x = 0; x < f->w; x++) {
-	 * 	F32 d = *(F32 *)&PIXEL(f, x, y);
+	 * 	F32 d = PIXEL(f, x, y);
 	 * 	F32 a = smoothstep(5, 0, fabs(d)) * 255;
 	 * 	PIXEL(f, x, y) = RGBA(a, a, a, 255);
 	 * }
@@ -1,13 +1,3 @@
-typedef enum {
-	SegLine,
-	SegQuad,
-} Segtype;
-
-typedef struct {
-	I16 x[3], y[3];
-	U8  type;
-} Segment;
-
 typedef struct {
 	I16     nseg;
 	Segment *segs;
@@ -32,7 +22,7 @@ typedef struct {
 
 U16 findglyph(Font f, U32 code);
 
-void drawbmp(Image *f, I16 x0, I16 y0, Glyph g, F64 scale);
-void drawbmpaa(Image *f, I16 x0, I16 y0, Glyph g, F64 scale);
+void drawbmp(ImageA8 *f, I16 x0, I16 y0, Glyph g, F64 scale);
+void drawbmpaa(ImageF32 *f, I16 x0, I16 y0, Glyph g, F64 scale);
 void drawoutline(Image *f, I16 x0, I16 y0, Glyph g, Color c, F64 scale);
-void drawsdf(Image *f, I16 x0, I16 y0, Glyph g, F64 scale);
+void drawsdf(ImageF32 *f, I16 x0, I16 y0, Glyph g, F64 scale);
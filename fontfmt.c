@@ -2,6 +2,7 @@
 #include "color.h"
 #include "image.h"
 #include "io.h"
+#include "draw.h"
 #include "font.h"
 #include "alloc.h"
 #include "math.h"
@@ -2,6 +2,7 @@
 #include "color.h"
 #include "math.h"
 #include "io.h"
+#include "alloc.h"
 #include "image.h"
 
 Image subimage(Image i, U16 x, U16 y, U16 w, U16 h)
@@ -13,5 +14,36 @@ Image subimage(Image i, U16 x, U16 y, U16 w, U16 h)
 	s.w = MIN(w, i.w - x);
 	s.h = MIN(h, i.h - y);
 	s.s = i.s;
+	s.mode = i.mode;
 	return s;
 }
+
+static void *newpixels(U64 n)
+{
+	U8 *p = memalloc(n);
+	__builtin_memset(p, 0, n);
+	return p;
+}
+
+Image newimage(U16 w, U16 h)
+{
+	return (Image){.w = w, .h = h, .s = w, .p = newpixels((U64)w*h*sizeof(Color))};
+}
+
+ImageA8 newimagea8(U16 w, U16 h)
+{
+	return (ImageA8){w, h, w, newpixels((U64)w*h)};
+}
+
+ImageF32 newimagef32(U16 w, U16 h)
+{
+	return (ImageF32){w, h, w, newpixels((U64)w*h*sizeof(F32))};
+}
+
+void f32toa8(ImageA8 *d, ImageF32 *s, F32 lo, F32 hi)
+{
+	F32 k = 255/(hi - lo);
+	for (I64 y = 0; y < MIN(d->h, s->h); y++)
+	for (I64 x = 0; x < MIN(d->w, s->w); x++)
+		PIXEL(d, x, y) = CLAMP((PIXEL(s, x, y) - lo)*k, 0, 255) + .5f;
+}
@@ -1,8 +1,31 @@
+/* NOTE: how the pixels are stored and blended, straight alpha by default.
+ * ImageSRGB is straight alpha too, but blended in linear light; it can be
+ * picked for a single draw call on a copy of the Image struct. */
+enum {
+	ImageStraight,
+	ImagePremul,
+	ImageSRGB,
+};
+
 typedef struct {
 	U16 w, h, s;
 	Color *p;
+	U8 mode;
 } Image;
 
+/* NOTE: Sibling layouts for what isn't a color: 8-bit coverage and
+ * floats (depth, signed distances, accumulators). PIXEL and the clipping
+ * macros work on all of them. */
+typedef struct {
+	U16 w, h, s;
+	U8  *p;
+} ImageA8;
+
+typedef struct {
+	U16 w, h, s;
+	F32 *p;
+} ImageF32;
+
 #define PIXEL(i, x, y) ((i)->p[(y)*(i)->s + (x)])
 #define CLIPX(i, x) (CLAMP((x), 0, (i)->w))
 #define CLIPY(i, y) (CLAMP((y), 0, (i)->h))
@@ -10,3 +33,11 @@ typedef struct {
 #define CHECKY(i, y) ((y) >= 0 && (y) < (i)->h)
 
 Image subimage(Image i, U16 x, U16 y, U16 w, U16 h);
+
+/* NOTE: zeroed, the pixels are freed with memfree(i.p) */
+Image    newimage(U16 w, U16 h);
+ImageA8  newimagea8(U16 w, U16 h);
+ImageF32 newimagef32(U16 w, U16 h);
+
+/* NOTE: values from lo to hi become coverages from 0 to 255 */
+void     f32toa8(ImageA8 *d, ImageF32 *s, F32 lo, F32 hi);
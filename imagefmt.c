@@ -1,38 +1,107 @@
 #include "types.h"
 #include "io.h"
 #include "color.h"
+#include "conv.h"
 #include "image.h"
 #include "alloc.h"
+#include "math.h"
+#include "par.h"
+#include "deflate.h"
 #include "imagefmt.h"
 
-/* TODO: a custom compressed image format based on k-means clustering
- * with 256-color palette (1 byte per pixel) */
+static OK ppmspace(U8 c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* NOTE: skips the whitespace and comments before the number */
+static OK ppmint(U8 **p, U8 *e, U32 *v)
+{
+	U8 *s = *p;
+	while (s < e && (ppmspace(*s) || *s == '#'))
+		if (*s++ == '#')
+			while (s < e && *s != '\n')
+				s++;
+	U64 x = 0;
+	U8 *d = s;
+	while (s < e && *s >= '0' && *s <= '9' && x <= MAXVAL(U16))
+		x = 10*x + (*s++ - '0');
+	*p = s;
+	*v = x;
+	return s != d && x <= MAXVAL(U16);
+}
 
+#define PPMBAND 64 /* rows */
+
+typedef struct {
+	U8    *s;
+	Color *p;
+	U8    *lut; /* NOTE: 0 when m is 255 */
+	U32   w, h, m;
+} Ppm;
+
+static void ppmband(void *ctx, U64 band)
+{
+	Ppm *c = ctx;
+	U32 y0 = band*PPMBAND, y1 = MIN(y0 + PPMBAND, c->h);
+	U64 bpp = c->m > 255 ? 6 : 3;
+	for (U32 y = y0; y < y1; y++) {
+		U8 *s = c->s + y*bpp*c->w;
+		Color *d = c->p + (U64)y*c->w;
+		if (!c->lut) {
+			unpackrgb(d, s, c->w);
+		} else if (bpp == 3) {
+			for (U32 x = 0; x < c->w; x++, s += 3)
+				d[x] = RGBA(c->lut[s[0]], c->lut[s[1]], c->lut[s[2]], 255);
+		} else {
+			for (U32 x = 0; x < c->w; x++, s += 6)
+				d[x] = RGBA(c->lut[s[0]<<8 | s[1]], c->lut[s[2]<<8 | s[3]], c->lut[s[4]<<8 | s[5]], 255);
+		}
+	}
+}
+
+/* NOTE: the file is mapped and converted in bands of rows, so it's
+ * bound by the memory bandwidth. For m other than 255 the samples go
+ * through a lookup table, which also covers 2-byte samples (m > 255).
+ * The samples above m are clamped. */
 Image loadppm(const char *path, Arena *a)
 {
 	Image i = {0};
-	IOBuffer b = {0};
-	if (!bopen(&b, path, 'r'))
+	U64 size;
+	U8 *f = mapfile(path, &size), *p = f, *e = f + size, *lut = 0;
+	if (!f)
 		return i;
-	U16 w, h, m;
-	if (!binput(&b, "P6", IWS, ID(&w), IWS, ID(&h), IWS, ID(&m), IWS1))
+	U32 w, h, m;
+	if (size < 2 || f[0] != 'P' || f[1] != '6')
 		goto out;
-	if (!m || m >= 256) /* TODO: 2-byte ppms */
+	p += 2;
+	if (!ppmint(&p, e, &w) || !ppmint(&p, e, &h) || !ppmint(&p, e, &m))
 		goto out;
-	Color *p = aralloc(a, w*h*sizeof(*p));
-	for (U16 y = 0; y < h; y++)
-	for (U16 x = 0; x < w; x++) {
-		U8 rv, gv, bv;
-		if (!binput(&b, ID(&rv), ID(&gv), ID(&bv)))
-			goto out;
-		p[y*w + x] = RGBA(rv*(U64)255/m, gv*(U64)255/m, bv*(U64)255/m, 255);
+	if (!m || p == e || !ppmspace(*p++))
+		goto out;
+	U64 bpp = m > 255 ? 6 : 3;
+	if ((U64)(e - p) < bpp*w*h)
+		goto out;
+	if (m != 255) {
+		U32 n = m > 255 ? MAXVAL(U16) + 1 : 256;
+		lut = memalloc(n);
+		for (U32 v = 0; v < n; v++)
+			lut[v] = (MIN(v, m)*255 + m/2)/m;
 	}
+	Ppm c = {p, aralloc(a, (U64)w*h*sizeof(Color)), lut, w, h, m};
+	U64 nband = divceil(h, PPMBAND);
+	if ((U64)w*h >= 256*256)
+		parfor(nband, ppmband, &c);
+	else
+		for (U64 k = 0; k < nband; k++)
+			ppmband(&c, k);
 	i.w = w;
 	i.h = h;
 	i.s = w;
-	i.p = p;
+	i.p = c.p;
 out:
-	bclose(&b);
+	memfree(lut);
+	unmapfile(f, size);
 	return i;
 }
 
@@ -52,17 +121,626 @@ OK image2c(Image *i, const char *var, const char *path)
 	return bclose(&b);
 }
 
+OK ppmopen(PpmWriter *p, const char *path, U16 w, U16 h)
+{
+	*p = (PpmWriter){.w = w, .h = h};
+	if (!bopen(&p->b, path, 'w'))
+		return 0;
+	p->row = memalloc(3*(U64)w + 1);
+	return bprintln(&p->b, "P6\n", OD(w), " ", OD(h), "\n", OD(255));
+}
+
+/* NOTE: each row is packed into the scratch buffer and goes out with one
+ * write, the band has to be as wide as the image */
+OK ppmwrite(PpmWriter *p, Image *band)
+{
+	if (band->w != p->w || band->h > p->h - p->y)
+		p->b.error = 1;
+	for (U16 y = 0; y < band->h && !p->b.error; y++) {
+		packrgb(p->row, &PIXEL(band, 0, y), p->w);
+		bwriten(&p->b, p->row, 3*(U64)p->w);
+	}
+	p->y += band->h;
+	return !p->b.error;
+}
+
+/* NOTE: fails if fewer rows were written than the header promised */
+OK ppmclose(PpmWriter *p)
+{
+	OK ok = p->y == p->h && !p->b.error;
+	memfree(p->row);
+	return bclose(&p->b) && ok;
+}
+
 OK image2ppm(Image *i, const char *path)
 {
+	PpmWriter p;
+	OK ok = ppmopen(&p, path, i->w, i->h) && ppmwrite(&p, i);
+	return ppmclose(&p) && ok;
+}
+
+/* NOTE: the palette format is "KPAL", then the width, the height and the
+ * number of colors n as little-endian U16s, n colors as B, G, R, A bytes
+ * and a byte per pixel of palette indices, row after row */
+
+#define PALCELLS   (1<<14) /* NOTE: 4 bits of R, G and B, 2 bits of alpha */
+#define PALSAMPLES ((U64)1<<16)
+#define PALCHUNKS  32
+#define PALITERS   16
+#define PALBAND    16 /* rows */
+
+/* NOTE: the nearest color search hashes a color into a cell of the RGBA
+ * space and only tries the palette entries that can be the nearest to
+ * some point of that cell: the ones that are not farther from the cell than
+ * the farthest point of the cell is from the best entry. The candidates go
+ * in the palette order, so the ties go to the lower index like in a full
+ * search. Only the cells the image has colors in get candidates. The
+ * distances to the cells are sums over the channels, so they are kept per
+ * channel and bucket. */
+typedef struct {
+	Color *pal;
+	U32   n;
+	OK    used[PALCELLS];
+	U32   start[PALCELLS+1]; /* NOTE: the candidates of cell c are cand[start[c]..start[c+1]) */
+	U8    *cand;
+	U32   near[4][16][256];
+	U32   far[4][16][256];
+} Palsearch;
+
+/* NOTE: opaque colors get an alpha bucket of their own, so they don't
+ * pay for the alpha extent of the cell */
+static U32 palcell(Color c)
+{
+	U32 a = A(c) == 255 ? 3 : A(c)/85;
+	return a<<12 | R(c)>>4<<8 | G(c)>>4<<4 | B(c)>>4;
+}
+
+static U32 coldist(Color a, Color b)
+{
+	I32 dr = (I32)R(a) - (I32)R(b), dg = (I32)G(a) - (I32)G(b);
+	I32 db = (I32)B(a) - (I32)B(b), da = (I32)A(a) - (I32)A(b);
+	return dr*dr + dg*dg + db*db + da*da;
+}
+
+static void palused(Palsearch *s, Image *i)
+{
+	__builtin_memset(s->used, 0, sizeof(s->used));
+	for (U16 y = 0; y < i->h; y++)
+	for (U16 x = 0; x < i->w; x++)
+		s->used[palcell(PIXEL(i, x, y))] = 1;
+	U64 n = 0;
+	for (U32 c = 0; c < PALCELLS; c++)
+		n += s->used[c];
+	s->cand = memalloc(256*n + 1);
+}
+
+static void palsearch(Palsearch *s, Color *pal, U32 n)
+{
+	static const U8 shift[4] = {16, 8, 0, 24};
+	s->pal = pal;
+	s->n = n;
+	for (U32 j = 0; j < 4; j++)
+	for (U32 b = 0; b < 16; b++) {
+		I32 lo = j < 3 ? 16*b : b < 3 ? 85*b : 255;
+		I32 hi = j < 3 ? lo + 15 : b < 3 ? lo + 84 : 255;
+		for (U32 k = 0; k < n; k++) {
+			I32 v = pal[k] >> shift[j] & 0xFF;
+			I32 d = lo > v ? lo - v : hi < v ? v - hi : 0, e = MAX(iabs(lo - v), iabs(hi - v));
+			s->near[j][b][k] = d*d;
+			s->far[j][b][k] = e*e;
+		}
+	}
+	U32 m = 0;
+	for (U32 c = 0; c < PALCELLS; c++) {
+		s->start[c] = m;
+		if (!s->used[c])
+			continue;
+		U32 rb = c>>8 & 15, gb = c>>4 & 15, bb = c & 15, ab = c>>12;
+		U32 best = MAXVAL(U32);
+		for (U32 k = 0; k < n; k++)
+			best = MIN(best, s->far[0][rb][k] + s->far[1][gb][k] + s->far[2][bb][k] + s->far[3][ab][k]);
+		for (U32 k = 0; k < n; k++)
+			if (s->near[0][rb][k] + s->near[1][gb][k] + s->near[2][bb][k] + s->near[3][ab][k] <= best)
+				s->cand[m++] = k;
+	}
+	s->start[PALCELLS] = m;
+}
+
+static U8 palnearest(Palsearch *s, Color c)
+{
+	U32 cell = palcell(c), best = MAXVAL(U32);
+	U8 k = 0;
+	for (U32 j = s->start[cell]; j < s->start[cell+1]; j++) {
+		U32 d = coldist(c, s->pal[s->cand[j]]);
+		if (d < best) {
+			best = d;
+			k = s->cand[j];
+		}
+	}
+	return k;
+}
+
+typedef struct {
+	Palsearch *s;
+	Color     *smp;
+	U64       n;
+	U64       (*sum)[5]; /* NOTE: R, G, B, A and the count, 256 per chunk */
+	Color     far[PALCHUNKS];
+	U32       fard[PALCHUNKS];
+} Kmeans;
+
+/* NOTE: each chunk has its own sums, so the result doesn't depend on
+ * the number of threads */
+static void kmeanschunk(void *ctx, U64 i)
+{
+	Kmeans *k = ctx;
+	U64 (*sum)[5] = k->sum + 256*i;
+	__builtin_memset(sum, 0, 256*sizeof(sum[0]));
+	k->fard[i] = 0;
+	for (U64 j = i*k->n/PALCHUNKS; j < (i + 1)*k->n/PALCHUNKS; j++) {
+		Color c = k->smp[j];
+		U8 p = palnearest(k->s, c);
+		U64 *t = sum[p];
+		t[0] += R(c);
+		t[1] += G(c);
+		t[2] += B(c);
+		t[3] += A(c);
+		t[4] += 1;
+		U32 d = coldist(c, k->s->pal[p]);
+		if (d > k->fard[i]) {
+			k->fard[i] = d;
+			k->far[i] = c;
+		}
+	}
+}
+
+/* NOTE: Lloyd's iterations over a sample of the pixels. The clusters that
+ * end up empty get the samples farthest from their centers. */
+static void kmeans(Palsearch *s, Color *pal, U32 n, Image *i)
+{
+	U64 np = (U64)i->w*i->h, ns = MIN(np, PALSAMPLES);
+	Kmeans k = {s, memalloc(ns*sizeof(Color)), ns, memalloc(PALCHUNKS*256*sizeof(k.sum[0])), {0}, {0}};
+	for (U64 j = 0; j < ns; j++) {
+		U64 p = j*np/ns;
+		k.smp[j] = PIXEL(i, p%i->w, p/i->w);
+	}
+	for (U32 j = 0; j < n; j++)
+		pal[j] = k.smp[(2*j + 1)*ns/(2*n)];
+	for (U32 it = 0; it < PALITERS; it++) {
+		palsearch(s, pal, n);
+		parfor(PALCHUNKS, kmeanschunk, &k);
+		OK moved = 0;
+		for (U32 j = 0; j < n; j++) {
+			U64 t[5] = {0};
+			for (U32 c = 0; c < PALCHUNKS; c++)
+				for (U32 e = 0; e < 5; e++)
+					t[e] += k.sum[256*c + j][e];
+			Color c = pal[j];
+			if (t[4]) {
+				c = RGBA((t[0] + t[4]/2)/t[4], (t[1] + t[4]/2)/t[4], (t[2] + t[4]/2)/t[4], (t[3] + t[4]/2)/t[4]);
+			} else {
+				/* NOTE: the farthest sample of the chunks, one per empty cluster */
+				U32 best = 0;
+				for (U32 e = 0; e < PALCHUNKS; e++)
+					if (k.fard[e] > k.fard[best])
+						best = e;
+				if (k.fard[best]) {
+					c = k.far[best];
+					k.fard[best] = 0;
+				}
+			}
+			moved |= c != pal[j];
+			pal[j] = c;
+		}
+		if (!moved)
+			break;
+	}
+	memfree(k.smp);
+	memfree(k.sum);
+}
+
+/* NOTE: the exact palette, if the image has no more than n colors */
+static U32 palexact(Color *pal, U32 n, Image *i)
+{
+	U32 set[512], m = 0;
+	OK used[512] = {0};
+	Color last = ~PIXEL(i, 0, 0);
+	for (U16 y = 0; y < i->h; y++)
+	for (U16 x = 0; x < i->w; x++) {
+		Color c = PIXEL(i, x, y);
+		if (c == last)
+			continue;
+		last = c;
+		U32 h = (c*2654435761U) >> 23;
+		while (used[h] && set[h] != c)
+			h = (h + 1)%512;
+		if (used[h])
+			continue;
+		if (m == n)
+			return 0;
+		used[h] = 1;
+		set[h] = c;
+		pal[m++] = c;
+	}
+	return m;
+}
+
+typedef struct {
+	Palsearch *s;
+	Image     *i;
+	U8        *idx;
+} Palencode;
+
+static void palband(void *ctx, U64 band)
+{
+	Palencode *e = ctx;
+	U32 y0 = band*PALBAND, y1 = MIN(y0 + PALBAND, e->i->h);
+	for (U32 y = y0; y < y1; y++) {
+		U8 *d = e->idx + (U64)y*e->i->w, p = 0;
+		Color last = ~PIXEL(e->i, 0, y);
+		for (U32 x = 0; x < e->i->w; x++) {
+			Color c = PIXEL(e->i, x, y);
+			if (c != last)
+				p = palnearest(e->s, c);
+			last = c;
+			d[x] = p;
+		}
+	}
+}
+
+/* NOTE: n is the palette size, up to 256 */
+OK image2pal(Image *i, const char *path, U32 n)
+{
+	n = MIN(MAX(n, 1U), 256U);
 	IOBuffer b = {0};
 	if (!bopen(&b, path, 'w'))
 		return 0;
-	bprintln(&b, "P6\n", OD(i->w), " ", OD(i->h), "\n", OD(255));
+	Color pal[256] = {0};
+	Palsearch *s = memalloc(sizeof(*s));
+	U8 *idx = memalloc((U64)i->w*i->h + 1);
+	s->cand = 0;
+	if (i->w && i->h) {
+		U32 m = palexact(pal, n, i);
+		palused(s, i);
+		if (m)
+			n = m;
+		else
+			kmeans(s, pal, n, i);
+		palsearch(s, pal, n);
+		Palencode e = {s, i, idx};
+		parfor(divceil(i->h, PALBAND), palband, &e);
+	}
+	U16 hdr[3] = {i->w, i->h, n};
+	bwriten(&b, (U8 *)"KPAL", 4);
+	for (U32 k = 0; k < 3; k++) {
+		bwrite(&b, hdr[k]);
+		bwrite(&b, hdr[k] >> 8);
+	}
+	for (U32 k = 0; k < n; k++) {
+		U8 c[4] = {B(pal[k]), G(pal[k]), R(pal[k]), A(pal[k])};
+		bwriten(&b, c, 4);
+	}
+	bwriten(&b, idx, (U64)i->w*i->h);
+	memfree(idx);
+	memfree(s->cand);
+	memfree(s);
+	return bclose(&b);
+}
+
+typedef struct {
+	U8    *idx;
+	Color *pal;
+	Image *i;
+} Paldecode;
+
+static void palexpandband(void *ctx, U64 band)
+{
+	Paldecode *e = ctx;
+	U32 y0 = band*PALBAND, y1 = MIN(y0 + PALBAND, e->i->h);
+	palexpand(&PIXEL(e->i, 0, y0), e->idx + (U64)y0*e->i->w, e->pal, (U64)(y1 - y0)*e->i->w);
+}
+
+Image loadpal(const char *path, Arena *a)
+{
+	Image i = {0};
+	U64 size;
+	U8 *f = mapfile(path, &size);
+	if (!f)
+		return i;
+	if (size < 10 || __builtin_memcmp(f, "KPAL", 4))
+		goto out;
+	U16 w = f[4] | f[5]<<8, h = f[6] | f[7]<<8, n = f[8] | f[9]<<8;
+	if (n > 256 || size - 10 < 4*n + (U64)w*h)
+		goto out;
+	Color pal[256] = {0};
+	for (U32 k = 0; k < n; k++) {
+		U8 *c = f + 10 + 4*k;
+		pal[k] = RGBA(c[2], c[1], c[0], c[3]);
+	}
+	U8 *idx = f + 10 + 4*n;
+	i.p = aralloc(a, (U64)w*h*sizeof(Color));
+	i.w = i.s = w;
+	i.h = h;
+	Paldecode e = {idx, pal, &i};
+	U64 nband = divceil(h, PALBAND);
+	if ((U64)w*h >= 256*256)
+		parfor(nband, palexpandband, &e);
+	else
+		for (U64 k = 0; k < nband; k++)
+			palexpandband(&e, k);
+out:
+	unmapfile(f, size);
+	return i;
+}
+
+/* NOTE: QOI (qoiformat.org) with 4 channels, the ops go through a small
+ * buffer, so both ways take constant memory besides the image */
+
+#define QOICHUNK   4096
+#define QOIHASH(c) ((R(c)*3 + G(c)*5 + B(c)*7 + A(c)*11)%64)
+
+static U8 qoiend[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+OK image2qoi(Image *i, const char *path)
+{
+	IOBuffer b = {0};
+	if (!bopen(&b, path, 'w'))
+		return 0;
+	U8 buf[QOICHUNK], hdr[14] = {'q', 'o', 'i', 'f', 0, 0, i->w >> 8, i->w, 0, 0, i->h >> 8, i->h, 4, 0};
+	bwriten(&b, hdr, sizeof(hdr));
+	Color idx[64] = {0}, prev = RGBA(0, 0, 0, 255);
+	U32 n = 0, run = 0;
 	for (U16 y = 0; y < i->h; y++)
 	for (U16 x = 0; x < i->w; x++) {
-		bwrite(&b, R(PIXEL(i, x, y)));
-		bwrite(&b, G(PIXEL(i, x, y)));
-		bwrite(&b, B(PIXEL(i, x, y)));
+		/* NOTE: a pixel adds at most 6 bytes */
+		if (n > QOICHUNK - 8) {
+			bwriten(&b, buf, n);
+			n = 0;
+		}
+		Color c = PIXEL(i, x, y);
+		if (c == prev) {
+			if (++run == 62) {
+				buf[n++] = 0xC0 | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			buf[n++] = 0xC0 | (run - 1);
+			run = 0;
+		}
+		U32 h = QOIHASH(c);
+		if (idx[h] == c) {
+			buf[n++] = h;
+			prev = c;
+			continue;
+		}
+		idx[h] = c;
+		I8 dr = R(c) - R(prev), dg = G(c) - G(prev), db = B(c) - B(prev);
+		I8 dgr = dr - dg, dgb = db - dg;
+		if (A(c) != A(prev)) {
+			buf[n++] = 0xFF;
+			buf[n++] = R(c);
+			buf[n++] = G(c);
+			buf[n++] = B(c);
+			buf[n++] = A(c);
+		} else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+			buf[n++] = 0x40 | (dr + 2)<<4 | (dg + 2)<<2 | (db + 2);
+		} else if (dg >= -32 && dg <= 31 && dgr >= -8 && dgr <= 7 && dgb >= -8 && dgb <= 7) {
+			buf[n++] = 0x80 | (dg + 32);
+			buf[n++] = (dgr + 8)<<4 | (dgb + 8);
+		} else {
+			buf[n++] = 0xFE;
+			buf[n++] = R(c);
+			buf[n++] = G(c);
+			buf[n++] = B(c);
+		}
+		prev = c;
+	}
+	if (run)
+		buf[n++] = 0xC0 | (run - 1);
+	bwriten(&b, buf, n);
+	bwriten(&b, qoiend, sizeof(qoiend));
+	return bclose(&b);
+}
+
+/* NOTE: the images are limited to 65535x65535 here, 3-channel files
+ * decode as opaque */
+Image loadqoi(const char *path, Arena *a)
+{
+	Image i = {0};
+	IOBuffer b = {0};
+	if (!bopen(&b, path, 'r'))
+		return i;
+	U8 buf[QOICHUNK + 8] = {0}, *h = buf;
+	if (breadn(&b, h, 14) != 14 || __builtin_memcmp(h, "qoif", 4) || h[4] || h[5] || h[8] || h[9])
+		goto out;
+	U16 w = h[6]<<8 | h[7], hh = h[10]<<8 | h[11];
+	Color *p = aralloc(a, (U64)w*hh*sizeof(Color)), idx[64] = {0}, c = RGBA(0, 0, 0, 255);
+	U64 n = 0, k = 0;
+	U32 run = 0;
+	for (U64 j = 0; j < (U64)w*hh; j++) {
+		if (run) {
+			run--;
+			p[j] = c;
+			continue;
+		}
+		if (n - k < 5) {
+			__builtin_memmove(buf, buf + k, n - k);
+			n -= k;
+			k = 0;
+			n += breadn(&b, buf + n, QOICHUNK - n);
+		}
+		if (k == n)
+			goto out;
+		U8 op = buf[k++];
+		if (op == 0xFE) {
+			c = RGBA(buf[k], buf[k+1], buf[k+2], A(c));
+			k += 3;
+		} else if (op == 0xFF) {
+			c = RGBA(buf[k], buf[k+1], buf[k+2], buf[k+3]);
+			k += 4;
+		} else if (op>>6 == 0) {
+			c = idx[op];
+		} else if (op>>6 == 1) {
+			c = RGBA((U8)(R(c) + (op>>4 & 3) - 2), (U8)(G(c) + (op>>2 & 3) - 2), (U8)(B(c) + (op & 3) - 2), A(c));
+		} else if (op>>6 == 2) {
+			U8 d = buf[k++];
+			I32 dg = (op & 63) - 32;
+			c = RGBA((U8)(R(c) + dg - 8 + (d>>4)), (U8)(G(c) + dg), (U8)(B(c) + dg - 8 + (d & 15)), A(c));
+		} else {
+			run = op & 63;
+		}
+		if (k > n)
+			goto out;
+		idx[QOIHASH(c)] = c;
+		p[j] = c;
+	}
+	/* NOTE: a file cut short anywhere, even in the end marker, is rejected */
+	__builtin_memmove(buf, buf + k, n - k);
+	n -= k;
+	n += breadn(&b, buf + n, QOICHUNK - n);
+	if (n < sizeof(qoiend) || __builtin_memcmp(buf, qoiend, sizeof(qoiend)))
+		goto out;
+	i.w = i.s = w;
+	i.h = hh;
+	i.p = p;
+out:
+	bclose(&b);
+	return i;
+}
+
+/* NOTE: 8-bit RGBA PNGs. The rows are split into bands, each band is
+ * filtered and deflated on its own (see deflate), so the bands compress
+ * in parallel at the cost of the matches across the band edges. */
+
+#define PNGBAND (512*KIB) /* NOTE: filtered bytes per band, roughly */
+
+static U8 paeth(U8 a, U8 b, U8 c)
+{
+	I32 p = a + b - c, pa = iabs(p - a), pb = iabs(p - b), pc = iabs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static void pngfilter(U8 *d, U8 f, U8 *x, U8 *up, U64 n)
+{
+	switch (f) {
+	case 0:
+		__builtin_memcpy(d, x, n);
+		break;
+	case 1:
+		for (U64 k = 0; k < n; k++)
+			d[k] = x[k] - (k >= 4 ? x[k-4] : 0);
+		break;
+	case 2:
+		for (U64 k = 0; k < n; k++)
+			d[k] = x[k] - up[k];
+		break;
+	case 3:
+		for (U64 k = 0; k < n; k++)
+			d[k] = x[k] - ((k >= 4 ? x[k-4] : 0) + up[k])/2;
+		break;
+	case 4:
+		for (U64 k = 0; k < n; k++)
+			d[k] = x[k] - (k >= 4 ? paeth(x[k-4], up[k], up[k-4]) : up[k]);
+		break;
+	}
+}
+
+typedef struct {
+	Image *i;
+	U8    level;
+	U32   rows;
+	U64   nband;
+	U8    *raw, *out; /* NOTE: the band k is at k*rawstride and k*outstride */
+	U64   rawstride, outstride;
+	U64   *size;
+	U32   *adler;
+} Png;
+
+/* NOTE: the filter of a row is the one with the smallest sum of the
+ * absolute differences, the usual heuristic. Level 0 doesn't filter. */
+static void pngband(void *ctx, U64 k)
+{
+	Png *p = ctx;
+	U64 w = 4*(U64)p->i->w, stride = w + 1;
+	U32 y0 = k*p->rows, y1 = MIN(y0 + p->rows, p->i->h);
+	/* NOTE: the scratch rows after the filtered ones hold Colors, so they start 4-aligned */
+	U8 *raw = p->raw + k*p->rawstride, *up = raw + divceil((y1 - y0)*stride, 4)*4, *x = up + w, *tmp = x + w;
+	if (y0)
+		swaprb((Color *)up, &PIXEL(p->i, 0, y0 - 1), p->i->w);
+	else
+		__builtin_memset(up, 0, w);
+	for (U32 y = y0; y < y1; y++) {
+		U8 *d = raw + (y - y0)*stride;
+		swaprb((Color *)x, &PIXEL(p->i, 0, y), p->i->w);
+		U64 best = MAXVAL(U64);
+		for (U8 f = 0; f < (p->level ? 5 : 1); f++) {
+			pngfilter(tmp, f, x, up, w);
+			U64 sum = 0;
+			for (U64 j = 0; j < w; j++)
+				sum += iabs((I8)tmp[j]);
+			if (sum < best) {
+				best = sum;
+				d[0] = f;
+				__builtin_memcpy(d + 1, tmp, w);
+			}
+		}
+		U8 *t = up;
+		up = x;
+		x = t;
+	}
+	U64 n = (y1 - y0)*stride;
+	p->adler[k] = adler32update(1, raw, n);
+	p->size[k] = deflate(p->out + k*p->outstride, raw, n, p->level, k + 1 == p->nband);
+}
+
+static void pngchunk(IOBuffer *b, const char *type, U8 *p, U64 n)
+{
+	U8 h[8] = {n >> 24, n >> 16, n >> 8, n, type[0], type[1], type[2], type[3]};
+	U32 c = crc32update(crc32update(0, h + 4, 4), p, n);
+	U8 t[4] = {c >> 24, c >> 16, c >> 8, c};
+	bwriten(b, h, 8);
+	bwriten(b, p, n);
+	bwriten(b, t, 4);
+}
+
+/* NOTE: level goes from 0 (stored) to 9 (smallest), see deflate */
+OK image2png(Image *i, const char *path, U8 level)
+{
+	if (!i->w || !i->h)
+		return 0;
+	IOBuffer b = {0};
+	if (!bopen(&b, path, 'w'))
+		return 0;
+	level = MIN(level, 9);
+	U64 w = 4*(U64)i->w, stride = w + 1;
+	Png p = {.i = i, .level = level, .rows = MAX(PNGBAND/stride, (U64)1)};
+	p.nband = divceil(i->h, p.rows);
+	p.rawstride = divceil(divceil(p.rows*stride, 4)*4 + 3*w, 16)*16;
+	p.outstride = divceil(deflatebound(p.rows*stride), 16)*16;
+	/* NOTE: the workers can't allocate, everything is allocated up front */
+	p.raw = memalloc(p.nband*(p.rawstride + p.outstride + sizeof(U64) + sizeof(U32)));
+	p.out = p.raw + p.nband*p.rawstride;
+	p.size = (U64 *)(p.out + p.nband*p.outstride);
+	p.adler = (U32 *)(p.size + p.nband);
+	parfor(p.nband, pngband, &p);
+
+	U8 sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	U8 ihdr[13] = {0, 0, i->w >> 8, i->w, 0, 0, i->h >> 8, i->h, 8, 6, 0, 0, 0};
+	U8 zhdr[2] = {0x78, level < 2 ? 0x01 : level < 6 ? 0x5E : level == 6 ? 0x9C : 0xDA};
+	bwriten(&b, sig, sizeof(sig));
+	pngchunk(&b, "IHDR", ihdr, sizeof(ihdr));
+	pngchunk(&b, "IDAT", zhdr, sizeof(zhdr));
+	U32 a = 1;
+	for (U64 k = 0; k < p.nband; k++) {
+		U32 y0 = k*p.rows, y1 = MIN(y0 + p.rows, i->h);
+		a = adler32combine(a, p.adler[k], (y1 - y0)*stride);
+		pngchunk(&b, "IDAT", p.out + k*p.outstride, p.size[k]);
 	}
+	U8 adler[4] = {a >> 24, a >> 16, a >> 8, a};
+	pngchunk(&b, "IDAT", adler, sizeof(adler));
+	pngchunk(&b, "IEND", 0, 0);
+	memfree(p.raw);
 	return bclose(&b);
 }
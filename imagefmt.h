@@ -1,3 +1,20 @@
 Image loadppm(const char *path, Arena *a);
 OK    image2c(Image *i, const char *var, const char *path);
 OK    image2ppm(Image *i, const char *path);
+Image loadpal(const char *path, Arena *a);
+OK    image2pal(Image *i, const char *path, U32 n);
+Image loadqoi(const char *path, Arena *a);
+OK    image2qoi(Image *i, const char *path);
+OK    image2png(Image *i, const char *path, U8 level);
+
+/* NOTE: writes a PPM band by band, so a renderer can stream the rows
+ * out as it finishes them */
+typedef struct {
+	IOBuffer b;
+	U8       *row;
+	U16      w, h, y;
+} PpmWriter;
+
+OK    ppmopen(PpmWriter *p, const char *path, U16 w, U16 h);
+OK    ppmwrite(PpmWriter *p, Image *band);
+OK    ppmclose(PpmWriter *p);
@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdarg.h>
 
@@ -48,6 +50,29 @@ OK bclose(IOBuffer *b)
 	return (b->mode == 'r' || bflush(b)) && !close(b->fd);
 }
 
+U8 *mapfile(const char *path, U64 *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return p;
+}
+
+void unmapfile(U8 *p, U64 size)
+{
+	if (p)
+		munmap(p, size);
+}
+
 I bpeek(IOBuffer *b)
 {
 	if (b->i == b->count) {
@@ -74,6 +99,20 @@ I bread(IOBuffer *b)
 	return c;
 }
 
+/* NOTE: reads less than n bytes only at the end of the file or on errors */
+U64 breadn(IOBuffer *b, U8 *p, U64 n)
+{
+	U64 k = 0;
+	while (k < n && bpeek(b) != -1) {
+		U64 m = b->count - b->i < n - k ? b->count - b->i : n - k;
+		__builtin_memcpy(p + k, b->bytes + b->i, m);
+		b->i += m;
+		b->pos += m;
+		k += m;
+	}
+	return k;
+}
+
 OK bflush(IOBuffer *b)
 {
 	if (b->error)
@@ -103,6 +142,33 @@ OK bwrite(IOBuffer *b, U8 v)
 	return 1;
 }
 
+/* NOTE: whatever doesn't fit into the buffer goes straight to write */
+OK bwriten(IOBuffer *b, U8 *p, U64 n)
+{
+	if (b->error)
+		return 0;
+	if (!n)
+		return 1;
+	if (b->i + n > IOBUFSIZE && !bflush(b))
+		return 0;
+	b->pos += n;
+	if (n < IOBUFSIZE) {
+		__builtin_memcpy(b->bytes + b->i, p, n);
+		b->i += n;
+		return 1;
+	}
+	while (n) {
+		ssize_t k = write(b->fd, p, n);
+		if (k < 0) {
+			b->error = 1;
+			return 0;
+		}
+		p += k;
+		n -= k;
+	}
+	return 1;
+}
+
 static void bprintu(U64 x, IOBuffer *b, U8 base, U8 bytes)
 {
 	char digits[64] = {0};
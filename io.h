@@ -15,11 +15,17 @@ OK bopen(IOBuffer *b, const char *path, U8 mode);
 OK bclose(IOBuffer *b);
 
 I  bread(IOBuffer *b);
+U64 breadn(IOBuffer *b, U8 *p, U64 n);
 I  bpeek(IOBuffer *b);
 OK bseek(IOBuffer *b, U64 byte);
 OK bwrite(IOBuffer *b, U8 v);
+OK bwriten(IOBuffer *b, U8 *p, U64 n);
 OK bflush(IOBuffer *b);
 
+/* NOTE: maps the whole file read-only, returns 0 on failure and for empty files */
+U8  *mapfile(const char *path, U64 *size);
+void unmapfile(U8 *p, U64 size);
+
 #define _INTFMT(type) ((U)(ISUNSIGNED(type)<<8 | sizeof(type)))
 
 #define _FMTEND (U)0, (U)0, (U)0 /* End of arguments, isn't supposed to be used explicitly */
@@ -0,0 +1,75 @@
+#include "types.h"
+#include "math.h"
+#include "alloc.h"
+#include "color.h"
+#include "image.h"
+#include "draw.h"
+#include "layer.h"
+
+Layers newlayers(U32 n, U16 w, U16 h)
+{
+	Layers s = {memalloc(n*sizeof(Layer)), n, memalloc(n*sizeof(Image)), 0};
+	for (U32 k = 0; k < n; k++) {
+		s.l[k] = (Layer){newimage(w, h), 255, 1};
+		s.l[k].i.mode = ImagePremul;
+		if (k + 1 < n) {
+			s.cache[k] = newimage(w, h);
+			s.cache[k].mode = ImagePremul;
+		}
+	}
+	return s;
+}
+
+void freelayers(Layers *s)
+{
+	for (U32 k = 0; k < s->n; k++) {
+		memfree(s->l[k].i.p);
+		if (k + 1 < s->n)
+			memfree(s->cache[k].p);
+	}
+	memfree(s->l);
+	memfree(s->cache);
+	*s = (Layers){0};
+}
+
+/* NOTE: d = b over nothing, then l over d; a zero b is an empty base */
+static void over(Image *d, Image *b, Layer *l, Color *tmp, Color *zero)
+{
+	U16 w = MIN(d->w, l->i.w), h = MIN(d->h, l->i.h);
+	U32 f = l->opacity + (l->opacity >> 7);
+	for (U16 y = 0; y < h; y++) {
+		Color *r = &PIXEL(d, 0, y), *s = &PIXEL(&l->i, 0, y);
+		if (b)
+			__builtin_memcpy(r, &PIXEL(b, 0, y), w*sizeof(r[0]));
+		else
+			fillspan(r, 0, w);
+		if (!f)
+			continue;
+		if (f != 256) {
+			lerpspan(tmp, zero, s, f, w);
+			s = tmp;
+		}
+		pmblendrow(r, s, w);
+	}
+}
+
+void flatten(Layers *s, Image *d)
+{
+	if (!s->n)
+		return;
+	U32 k0 = 0;
+	while (k0 < s->n && !s->l[k0].dirty)
+		k0++;
+	s->nvalid = MIN(s->nvalid, k0);
+	U16 w = s->l[0].i.w;
+	Color *tmp = memalloc(2*w*sizeof(Color)), *zero = tmp + w;
+	fillspan(zero, 0, w);
+	for (U32 k = s->nvalid; k + 1 < s->n; k++)
+		over(&s->cache[k], k ? &s->cache[k-1] : 0, &s->l[k], tmp, zero);
+	s->nvalid = s->n - 1;
+	over(d, s->n > 1 ? &s->cache[s->n - 2] : 0, &s->l[s->n - 1], tmp, zero);
+	for (U32 k = 0; k < s->n; k++)
+		s->l[k].dirty = 0;
+	adddamage(d, 0, 0, d->w, d->h);
+	memfree(tmp);
+}
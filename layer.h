@@ -0,0 +1,23 @@
+/* NOTE: A stack of same-sized layers, the first one is at the bottom.
+ * Layers are premultiplied images, whoever draws into one sets its dirty
+ * flag (also after changing its opacity). Flattening keeps the composites
+ * of every prefix of the stack, so only the layers from the lowest dirty
+ * one up get composited again, and a frame where only the top layer
+ * changes costs a copy and a blend. */
+typedef struct {
+	Image i;
+	U8    opacity;
+	OK    dirty;
+} Layer;
+
+typedef struct {
+	Layer *l;
+	U32   n;
+	Image *cache; /* NOTE: cache[k] is layers 0..k flattened, there are n - 1 */
+	U32   nvalid;
+} Layers;
+
+Layers newlayers(U32 n, U16 w, U16 h);
+void   freelayers(Layers *s);
+/* NOTE: the result is premultiplied too, on screen that's the stack over black */
+void   flatten(Layers *s, Image *d);
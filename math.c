@@ -94,6 +94,12 @@ I64 divround(I64 x, I64 y)
 	return (c ^ s) - s;
 }
 
+I64 divfloor(I64 x, I64 y)
+{
+	I64 q = x / y;
+	return q - ((x % y != 0) & ((x < 0) != (y < 0)));
+}
+
 I64 imod(I64 x, U32 y)
 {
 	return (x%y + y) % y;
@@ -27,6 +27,7 @@ I64 cpsign(I64 x, I64 y);
 U64 iabs(I64 v);
 U64 divceil(U64 x, U64 y);
 I64 divround(I64 x, I64 y);
+I64 divfloor(I64 x, I64 y);
 I64 imod(I64 x, U32 y);
 
 F64 fsqrt(F64 x);
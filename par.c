@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "math.h"
+#include "par.h"
+
+#define MAXWORKERS 64
+
+/* NOTE: this is a minimal persistent thread pool: workers sleep on a condition
+ * variable until a new job generation is published, then grab indices from
+ * a shared counter. The caller thread participates too, so with one cpu
+ * parfor degrades into a plain loop without any context switches. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake, done;
+	pthread_mutex_t joblock; /* serializes concurrent parfor calls */
+	U32 nworkers;
+	U64 gen;
+	U32 running;
+	void (*f)(void *ctx, U64 i);
+	void *ctx;
+	U64 n, next;
+} Pool;
+
+static Pool defpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.joblock = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t poolonce = PTHREAD_ONCE_INIT;
+static __thread OK inworker;
+
+U32 ncpu(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return CLAMP(n, 1, MAXWORKERS);
+}
+
+static void runjob(Pool *p)
+{
+	for (;;) {
+		U64 i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+		if (i >= p->n)
+			break;
+		p->f(p->ctx, i);
+	}
+}
+
+static void *worker(void *arg)
+{
+	Pool *p = arg;
+	U64 seen = 0;
+	inworker = 1;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->gen == seen)
+			pthread_cond_wait(&p->wake, &p->lock);
+		seen = p->gen;
+		pthread_mutex_unlock(&p->lock);
+		runjob(p);
+		pthread_mutex_lock(&p->lock);
+		p->running -= 1;
+		if (!p->running)
+			pthread_cond_signal(&p->done);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return 0;
+}
+
+static void poolinit(void)
+{
+	Pool *p = &defpool;
+	for (U32 i = 1; i < ncpu(); i++) {
+		pthread_t t;
+		if (pthread_create(&t, 0, worker, p))
+			break;
+		pthread_detach(t);
+		p->nworkers += 1;
+	}
+}
+
+void parfor(U64 n, void (*f)(void *ctx, U64 i), void *ctx)
+{
+	Pool *p = &defpool;
+	pthread_once(&poolonce, poolinit);
+	/* NOTE: nested calls from inside a job just run serially */
+	if (inworker || !p->nworkers || n <= 1) {
+		for (U64 i = 0; i < n; i++)
+			f(ctx, i);
+		return;
+	}
+	pthread_mutex_lock(&p->joblock);
+	pthread_mutex_lock(&p->lock);
+	p->f = f;
+	p->ctx = ctx;
+	p->n = n;
+	p->next = 0;
+	p->running = p->nworkers;
+	p->gen += 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	inworker = 1;
+	runjob(p);
+	inworker = 0;
+	pthread_mutex_lock(&p->lock);
+	while (p->running)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	pthread_mutex_unlock(&p->joblock);
+}
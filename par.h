@@ -0,0 +1,2 @@
+U32  ncpu(void);
+void parfor(U64 n, void (*f)(void *ctx, U64 i), void *ctx);
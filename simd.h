@@ -0,0 +1,20 @@
+/* NOTE: SSE2 helpers shared by the span kernels, bit-exact with the
+ * scalar code they stand for */
+#if defined(__SSE2__)
+#include <immintrin.h>
+
+/* NOTE: channel sh of 8 pixels in 16-bit lanes */
+static inline __m128i chan16(__m128i a, __m128i b, int sh)
+{
+	__m128i m = _mm_set1_epi32(0xFF);
+	return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, sh), m), _mm_and_si128(_mm_srli_epi32(b, sh), m));
+}
+
+/* NOTE: BGRA <-> RGBA for 4 pixels */
+static inline __m128i swaprb4(__m128i x)
+{
+	__m128i ga = _mm_set1_epi32(0xFF00FF00), c = _mm_set1_epi32(0xFF);
+	__m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 16), c), _mm_slli_epi32(_mm_and_si128(x, c), 16));
+	return _mm_or_si128(_mm_and_si128(x, ga), rb);
+}
+#endif
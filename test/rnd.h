@@ -0,0 +1,8 @@
+/* NOTE: a tiny LCG for the test data, the same sequence on every run */
+static U32 seed = 1;
+
+static U32 rnd(void)
+{
+	seed = seed*1103515245 + 12345;
+	return seed >> 7 ^ seed << 13;
+}
@@ -0,0 +1,188 @@
+#include "types.h"
+#include "color.h"
+#include "math.h"
+#include "utest.h"
+#include "rnd.h"
+
+#define N 1003 /* NOTE: odd on purpose, to exercise the scalar tails */
+
+/* NOTE: makes the extreme alpha and coverage values more likely */
+static U8 rndbyte(void)
+{
+	U32 v = rnd();
+	switch (v%8) {
+	case 0: return 0;
+	case 1: return 255;
+	default: return v >> 8;
+	}
+}
+
+static Color rndcolor(void)
+{
+	return RGBA((U8)rnd(), (U8)(rnd() >> 5), (U8)(rnd() >> 11), rndbyte());
+}
+
+TESTSUITE("color span kernels") {
+	Color d[N], r[N];
+	U8 cov[N];
+	TESTCASE("fillspan") {
+		Color c = rndcolor();
+		fillspan(d, c, N);
+		OK ok = 1;
+		for (U32 k = 0; k < N; k++)
+			ok &= d[k] == c;
+		REQUIRE(ok);
+	}
+	TESTCASE("blendfill is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = rndcolor();
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor();
+			blendfill(d + t%5, c, N - t%5);
+			for (U32 k = t%5; k < N; k++)
+				ok &= d[k] == blend(r[k], c);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("blendspan is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = rndcolor();
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor(), cov[k] = rndbyte();
+			blendspan(d, c, cov, N);
+			for (U32 k = 0; k < N; k++) {
+				U8 a = (A(c)*cov[k] + 127)/255;
+				ok &= d[k] == (cov[k] ? blend(r[k], SETA(c, a)) : r[k]);
+			}
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("composespan is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = rndcolor();
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor(), cov[k] = rndbyte();
+			composespan(d, c, cov, N);
+			for (U32 k = 0; k < N; k++) {
+				U8 a = (A(c)*cov[k] + 127)/255;
+				ok &= d[k] == (cov[k] ? compose(r[k], SETA(c, a)) : r[k]);
+			}
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("pmblendfill is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = premul(rndcolor());
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = premul(rndcolor());
+			pmblendfill(d + t%5, c, N - t%5);
+			for (U32 k = t%5; k < N; k++)
+				ok &= d[k] == pmblend(r[k], c);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("pmblendspan is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = premul(rndcolor());
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = premul(rndcolor()), cov[k] = rndbyte();
+			pmblendspan(d, c, cov, N);
+			for (U32 k = 0; k < N; k++) {
+				U32 v = cov[k];
+				Color s = RGBA((R(c)*v + 127)/255, (G(c)*v + 127)/255, (B(c)*v + 127)/255, (A(c)*v + 127)/255);
+				ok &= d[k] == (cov[k] ? pmblend(r[k], s) : r[k]);
+			}
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("pmblend agrees with compose") {
+		OK ok = 1;
+		for (U32 k = 0; k < 100000; k++) {
+			Color b = rndcolor(), t = rndcolor();
+			Color x = pmblend(premul(b), premul(t)), y = premul(compose(b, t));
+			ok &= iabs((I64)R(x) - R(y)) <= 2 && iabs((I64)G(x) - G(y)) <= 2;
+			ok &= iabs((I64)B(x) - B(y)) <= 2 && iabs((I64)A(x) - A(y)) <= 1;
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("srgbblend keeps opaque and transparent colors") {
+		OK ok = 1;
+		srgbinit();
+		for (U32 k = 0; k < 256*256; k++) {
+			Color b = RGBA(k & 0xFF, k >> 8, (k*7) & 0xFF, 0), t = RGBA(k >> 8, (k*3) & 0xFF, k & 0xFF, 0);
+			ok &= srgbblend(b, SETA(t, 255)) == t && srgbblend(b, t) == b;
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("srgbblendfill is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = rndcolor();
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor();
+			srgbblendfill(d + t%5, c, N - t%5);
+			for (U32 k = t%5; k < N; k++)
+				ok &= d[k] == srgbblend(r[k], c);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("srgbblendspan is exact") {
+		OK ok = 1;
+		for (U32 t = 0; t < 300; t++) {
+			Color c = rndcolor();
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor(), cov[k] = rndbyte();
+			srgbblendspan(d, c, cov, N);
+			for (U32 k = 0; k < N; k++) {
+				U8 a = (A(c)*cov[k] + 127)/255;
+				ok &= d[k] == (cov[k] ? srgbblend(r[k], SETA(c, a)) : r[k]);
+			}
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("blendrow and pmblendrow are exact") {
+		OK ok = 1;
+		Color t[N];
+		for (U32 i = 0; i < 100; i++) {
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = rndcolor(), t[k] = rndcolor();
+			blendrow(d + i%5, t, N - i%5);
+			for (U32 k = i%5; k < N; k++)
+				ok &= d[k] == blend(r[k], t[k - i%5]);
+			for (U32 k = 0; k < N; k++)
+				d[k] = r[k] = premul(rndcolor()), t[k] = premul(rndcolor());
+			pmblendrow(d, t, N);
+			for (U32 k = 0; k < N; k++)
+				ok &= d[k] == pmblend(r[k], t[k]);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("lerpspan and lerpgather are exact") {
+		OK ok = 1;
+		Color t[N+1];
+		U32 x[N];
+		U8 f[N];
+		for (U32 i = 0; i < 100; i++) {
+			U32 w = rnd()%257;
+			for (U32 k = 0; k < N; k++)
+				r[k] = rndcolor(), t[k] = rndcolor(), x[k] = rnd()%N, f[k] = rndbyte();
+			lerpspan(d, r, t, w, N - i%5);
+			for (U32 k = 0; k < N - i%5; k++) {
+				Color a = r[k], b = t[k];
+				Color e = RGBA((R(a)*(256 - w) + R(b)*w + 128) >> 8, (G(a)*(256 - w) + G(b)*w + 128) >> 8,
+					(B(a)*(256 - w) + B(b)*w + 128) >> 8, (A(a)*(256 - w) + A(b)*w + 128) >> 8);
+				ok &= d[k] == e && lerpcolor(a, b, w) == e;
+			}
+			t[N] = rndcolor();
+			lerpgather(d, t, x, f, N - i%5);
+			for (U32 k = 0; k < N - i%5; k++)
+				ok &= d[k] == lerpcolor(t[x[k]], t[x[k] + 1], f[k]);
+		}
+		REQUIRE(ok);
+	}
+}
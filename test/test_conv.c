@@ -0,0 +1,85 @@
+#include "types.h"
+#include "color.h"
+#include "conv.h"
+#include "utest.h"
+#include "rnd.h"
+
+#define N 1003 /* NOTE: odd on purpose, to exercise the scalar tails */
+
+TESTSUITE("pixel format conversions") {
+	Color s[N], t[N], d[N];
+	U8 y[N], u[N], v[N], w[N];
+	for (U32 k = 0; k < N; k++)
+		s[k] = rnd(), t[k] = rnd();
+	TESTCASE("YCbCr and gray keep their ranges") {
+		REQUIRE(toy(RGBA(0, 0, 0, 0)) == 16 && toy(WHITE) == 235);
+		REQUIRE(tocb(WHITE) == 128 && tocr(WHITE) == 128);
+		REQUIRE(togray(RGBA(0, 0, 0, 0)) == 0 && togray(WHITE) == 255);
+	}
+	TESTCASE("swaps are exact") {
+		OK ok = 1;
+		for (U32 i = 0; i < 5; i++) {
+			swaprb(d, s + i, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= d[k] == RGBA(B(s[k+i]), G(s[k+i]), R(s[k+i]), A(s[k+i]));
+			reversespan(d, s + i, N - i);
+			reversespan(d, d, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= d[k] == s[k+i];
+		}
+		REQUIRE(ok && (reversespan(d, &(Color){0x11223344}, 1), d[0] == 0x44332211));
+	}
+	TESTCASE("toycc444 and tograyspan are exact") {
+		OK ok = 1;
+		for (U32 i = 0; i < 5; i++) {
+			toycc444(y, u, v, s + i, N - i);
+			tograyspan(w, s + i, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= y[k] == toy(s[k+i]) && u[k] == tocb(s[k+i]) && v[k] == tocr(s[k+i]) && w[k] == togray(s[k+i]);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("toycc420 is exact") {
+		OK ok = 1;
+		for (U32 i = 0; i < 5; i++) {
+			U64 n = N - i;
+			toycc420(y, w, u, v, s, t, n);
+			for (U32 k = 0; k < n; k++)
+				ok &= y[k] == toy(s[k]) && w[k] == toy(t[k]);
+			for (U32 k = 0; 2*k < n; k++) {
+				U32 x1 = 2*k + 1 < n ? 2*k + 1 : 2*k;
+				Color p = s[2*k], q = s[x1], a = t[2*k], b = t[x1];
+				Color c = RGBA((R(p) + R(q) + R(a) + R(b) + 2)/4, (G(p) + G(q) + G(a) + G(b) + 2)/4,
+					(B(p) + B(q) + B(a) + B(b) + 2)/4, 0);
+				ok &= u[k] == tocb(c) && v[k] == tocr(c);
+			}
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("packrgb and unpackrgb round-trip") {
+		OK ok = 1;
+		U8 p[3*N];
+		for (U32 i = 0; i < 5; i++) {
+			p[3*N-1] = 0xAB;
+			packrgb(p, s, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= p[3*k] == R(s[k]) && p[3*k+1] == G(s[k]) && p[3*k+2] == B(s[k]);
+			ok &= i == 0 || p[3*N-1] == 0xAB;
+			unpackrgb(d, p, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= d[k] == SETA(s[k], 255U);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("palexpand is exact") {
+		OK ok = 1;
+		for (U32 i = 0; i < 5; i++) {
+			for (U32 k = 0; k < N; k++)
+				y[k] = rnd();
+			palexpand(d, y + i, s, N - i);
+			for (U32 k = 0; k < N - i; k++)
+				ok &= d[k] == s[y[k+i]];
+		}
+		REQUIRE(ok);
+	}
+}
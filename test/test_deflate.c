@@ -0,0 +1,211 @@
+#include "types.h"
+#include "deflate.h"
+#include "utest.h"
+#include "rnd.h"
+
+#define N 100000
+
+/* NOTE: a plain inflate, to check that the streams decode */
+
+typedef struct {
+	U8  *p;
+	U64 n, k; /* NOTE: k counts bits */
+} In;
+
+typedef struct {
+	U16 count[16], sym[288];
+} Code;
+
+static const U8 order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+static const U16 lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const U8 lextra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const U16 dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const U8 dextra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static U32 getbits(In *in, U32 n)
+{
+	U32 v = 0;
+	for (U32 j = 0; j < n; j++, in->k++)
+		if (in->k < 8*in->n)
+			v |= (in->p[in->k/8] >> in->k%8 & 1) << j;
+	return v;
+}
+
+static void mkcode(Code *c, U8 *len, U32 n)
+{
+	U16 off[16] = {0};
+	__builtin_memset(c->count, 0, sizeof(c->count));
+	for (U32 k = 0; k < n; k++)
+		c->count[len[k]] += 1;
+	for (U32 l = 1; l < 15; l++)
+		off[l+1] = off[l] + c->count[l];
+	for (U32 k = 0; k < n; k++)
+		if (len[k])
+			c->sym[off[len[k]]++] = k;
+}
+
+/* NOTE: the codes come most significant bit first */
+static I32 decode(In *in, Code *c)
+{
+	I32 code = 0, first = 0, index = 0;
+	for (U32 l = 1; l < 16; l++) {
+		code |= getbits(in, 1);
+		if (code - first < c->count[l])
+			return c->sym[index + code - first];
+		index += c->count[l];
+		first = (first + c->count[l]) << 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+/* NOTE: returns the size of the output, -1 for a broken stream */
+static I64 inflate(U8 *d, U64 cap, U8 *s, U64 n)
+{
+	In in = {s, n, 0};
+	U64 o = 0;
+	U32 final;
+	do {
+		final = getbits(&in, 1);
+		U32 type = getbits(&in, 2);
+		if (type == 0) {
+			in.k = (in.k + 7)/8*8;
+			U32 len = getbits(&in, 16), nlen = getbits(&in, 16);
+			if (len != (~nlen & 0xFFFF) || o + len > cap || in.k/8 + len > n)
+				return -1;
+			__builtin_memcpy(d + o, s + in.k/8, len);
+			o += len;
+			in.k += 8*len;
+			continue;
+		}
+		if (type == 3)
+			return -1;
+		Code lc, dc;
+		U8 len[288 + 32];
+		if (type == 1) {
+			for (U32 k = 0; k < 288; k++)
+				len[k] = k < 144 ? 8 : k < 256 ? 9 : k < 280 ? 7 : 8;
+			for (U32 k = 0; k < 30; k++)
+				len[288 + k] = 5;
+			mkcode(&lc, len, 288);
+			mkcode(&dc, len + 288, 30);
+		} else {
+			U32 nl = getbits(&in, 5) + 257, nd = getbits(&in, 5) + 1, nc = getbits(&in, 4) + 4;
+			U8 cl[19] = {0};
+			for (U32 k = 0; k < nc; k++)
+				cl[order[k]] = getbits(&in, 3);
+			Code cc;
+			mkcode(&cc, cl, 19);
+			for (U32 k = 0; k < nl + nd;) {
+				I32 sym = decode(&in, &cc);
+				U32 r;
+				U8 v = 0;
+				if (sym < 0)
+					return -1;
+				if (sym < 16) {
+					len[k++] = sym;
+					continue;
+				}
+				if (sym == 16) {
+					if (!k)
+						return -1;
+					v = len[k-1];
+					r = 3 + getbits(&in, 2);
+				} else {
+					r = sym == 17 ? 3 + getbits(&in, 3) : 11 + getbits(&in, 7);
+				}
+				if (k + r > nl + nd)
+					return -1;
+				while (r--)
+					len[k++] = v;
+			}
+			mkcode(&lc, len, nl);
+			mkcode(&dc, len + nl, nd);
+		}
+		for (;;) {
+			I32 sym = decode(&in, &lc);
+			if (sym < 0 || sym > 285)
+				return -1;
+			if (sym < 256) {
+				if (o == cap)
+					return -1;
+				d[o++] = sym;
+				continue;
+			}
+			if (sym == 256)
+				break;
+			U32 l = lbase[sym - 257] + getbits(&in, lextra[sym - 257]);
+			I32 ds = decode(&in, &dc);
+			if (ds < 0 || ds > 29)
+				return -1;
+			U32 dist = dbase[ds] + getbits(&in, dextra[ds]);
+			if (dist > o || o + l > cap)
+				return -1;
+			for (; l; l--, o++)
+				d[o] = d[o - dist];
+		}
+	} while (!final && in.k <= 8*n);
+	return in.k <= 8*n ? (I64)o : -1;
+}
+
+TESTSUITE("deflate and its checksums") {
+	/* NOTE: words for matches of all sorts, runs, and noise for the
+	 * stored blocks */
+	static U8 s[N], r[N], o[N], d[N + N/8];
+	static const char words[] = "the     quick   brown   fox     jumps   over    lazy    dogs    ";
+	for (U32 k = 0; k < N; k += 8) {
+		U32 w = rnd()%8;
+		for (U32 j = 0; j < 8 && k + j < N; j++)
+			s[k+j] = words[8*w + j];
+	}
+	for (U32 k = 0; k < N; k++) {
+		if (k%40000 >= 20000)
+			s[k] = k%40000 < 30000 ? k/1000 : rnd();
+		r[k] = rnd();
+	}
+	TESTCASE("checksums match the known values") {
+		REQUIRE(crc32update(0, (U8 *)"123456789", 9) == 0xCBF43926);
+		REQUIRE(crc32update(crc32update(0, (U8 *)"1234", 4), (U8 *)"56789", 5) == 0xCBF43926);
+		REQUIRE(adler32update(1, (U8 *)"Wikipedia", 9) == 0x11E60398);
+	}
+	TESTCASE("adler32combine joins the pieces") {
+		U32 a = adler32update(1, s, 7777), b = adler32update(1, s + 7777, N - 7777);
+		REQUIRE(adler32combine(a, b, N - 7777) == adler32update(1, s, N));
+		REQUIRE(adler32combine(a, 1, 0) == a);
+	}
+	TESTCASE("every level inflates back") {
+		OK ok = deflatebound(N) <= sizeof(d);
+		for (U8 l = 0; l <= 9; l++) {
+			U64 n = deflate(d, s, N, l, 1);
+			ok &= n <= deflatebound(N) && (l == 0 ? n > N : n < N);
+			ok &= inflate(o, N, d, n) == N && !__builtin_memcmp(o, s, N);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("pieces concatenate into one stream") {
+		OK ok = 1;
+		for (U8 l = 0; l <= 9; l++) {
+			U64 n = deflate(d, s, 30000, l, 0);
+			n += deflate(d + n, s + 30000, 0, l, 0);
+			n += deflate(d + n, s + 30000, N - 30000, l, 1);
+			ok &= inflate(o, N, d, n) == N && !__builtin_memcmp(o, s, N);
+		}
+		REQUIRE(ok);
+	}
+	TESTCASE("noise doesn't come out bigger than stored") {
+		OK ok = 1;
+		U64 n0 = deflate(d, r, N, 0, 1);
+		for (U8 l = 1; l <= 9; l++)
+			ok &= deflate(d, r, N, l, 1) <= n0;
+		REQUIRE(ok && inflate(o, N, d, deflate(d, r, N, 1, 1)) == N && !__builtin_memcmp(o, r, N));
+	}
+	TESTCASE("stored output keeps the input verbatim") {
+		U64 n = deflate(d, s, 100, 0, 1);
+		REQUIRE(n == 105 && d[0] == 1 && d[1] == 100 && d[3] == 0xFF - 100);
+		REQUIRE(!__builtin_memcmp(d + 5, s, 100));
+	}
+}
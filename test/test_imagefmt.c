@@ -0,0 +1,132 @@
+#include "types.h"
+#include "color.h"
+#include "image.h"
+#include "alloc.h"
+#include "io.h"
+#include "imagefmt.h"
+#include "utest.h"
+#include "rnd.h"
+
+static OK same(Image *a, Image *b)
+{
+	if (!a->p || !b->p || a->w != b->w || a->h != b->h)
+		return 0;
+	for (U32 y = 0; y < a->h; y++)
+		for (U32 x = 0; x < a->w; x++)
+			if (PIXEL(a, x, y) != PIXEL(b, x, y))
+				return 0;
+	return 1;
+}
+
+/* NOTE: copies the file at s to d without its last n bytes */
+static OK truncated(const char *d, const char *s, U64 n)
+{
+	U64 size;
+	U8 *f = mapfile(s, &size);
+	IOBuffer b = {0};
+	OK ok = f && n <= size && bopen(&b, d, 'w') && bwriten(&b, f, size - n) && bclose(&b);
+	unmapfile(f, size);
+	return ok;
+}
+
+static U32 coldist(Color a, Color b)
+{
+	I32 dr = (I32)R(a) - (I32)R(b), dg = (I32)G(a) - (I32)G(b);
+	I32 db = (I32)B(a) - (I32)B(b), da = (I32)A(a) - (I32)A(b);
+	return dr*dr + dg*dg + db*db + da*da;
+}
+
+TESTSUITE("image formats") {
+	Arena a = {0};
+	Image big = newimage(301, 257), small = newimage(13, 7);
+	Color pal[256];
+	for (U32 k = 0; k < 256; k++)
+		pal[k] = RGBA(rnd(), rnd(), rnd(), k%3 ? 255 : rnd());
+	for (U32 y = 0; y < big.h; y++)
+		for (U32 x = 0; x < big.w; x++)
+			PIXEL(&big, x, y) = pal[(x/5 + y*3)%256];
+	for (U32 y = 0; y < small.h; y++)
+		for (U32 x = 0; x < small.w; x++)
+			PIXEL(&small, x, y) = pal[rnd()%40];
+	TESTCASE("palette images with up to 256 colors round-trip") {
+		Image b = (image2pal(&big, "/tmp/test_imagefmt.pal", 256), loadpal("/tmp/test_imagefmt.pal", &a));
+		Image s = (image2pal(&small, "/tmp/test_imagefmt.pal", 256), loadpal("/tmp/test_imagefmt.pal", &a));
+		REQUIRE(same(&big, &b) && same(&small, &s));
+	}
+	TESTCASE("palette images with more colors get the nearest entries") {
+		/* NOTE: 432 colors of a coarse lattice, so the palette comes from
+		 * k-means and lots of pixels are as far from two entries, where
+		 * the lower index has to win as in a full search */
+		Image m = newimage(211, 97);
+		for (U32 y = 0; y < m.h; y++)
+			for (U32 x = 0; x < m.w; x++)
+				PIXEL(&m, x, y) = RGBA(rnd()%6*51, rnd()%6*51, rnd()%6*51, rnd()%2 ? 255 : 102);
+		OK ok = 1;
+		U64 ties = 0;
+		for (U32 n = 16; n <= 256; n += 240) {
+			Image d = (image2pal(&m, "/tmp/test_imagefmt.pal", n), loadpal("/tmp/test_imagefmt.pal", &a));
+			U64 size;
+			U8 *f = mapfile("/tmp/test_imagefmt.pal", &size);
+			ok &= f && d.p && size == 10 + 4*n + (U64)m.w*m.h && (U32)(f[8] | f[9]<<8) == n;
+			if (!ok)
+				break;
+			Color pal[256];
+			for (U32 k = 0; k < n; k++)
+				pal[k] = RGBA(f[12 + 4*k], f[11 + 4*k], f[10 + 4*k], f[13 + 4*k]);
+			U8 *idx = f + 10 + 4*n;
+			for (U32 y = 0; y < m.h; y++)
+				for (U32 x = 0; x < m.w; x++) {
+					Color c = PIXEL(&m, x, y);
+					U32 best = coldist(c, pal[0]), k = 0, nbest = 1;
+					for (U32 e = 1; e < n; e++) {
+						U32 dist = coldist(c, pal[e]);
+						if (dist < best)
+							best = dist, k = e, nbest = 1;
+						else if (dist == best)
+							nbest += 1;
+					}
+					ties += nbest > 1;
+					ok &= idx[y*m.w + x] == k && PIXEL(&d, x, y) == pal[k];
+				}
+			unmapfile(f, size);
+		}
+		REQUIRE(ok && ties);
+		memfree(m.p);
+	}
+	TESTCASE("truncated palette images don't load") {
+		OK ok = truncated("/tmp/test_imagefmt.bad", "/tmp/test_imagefmt.pal", 0);
+		ok &= loadpal("/tmp/test_imagefmt.bad", &a).p != 0;
+		ok &= truncated("/tmp/test_imagefmt.bad", "/tmp/test_imagefmt.pal", 1);
+		REQUIRE(ok && !loadpal("/tmp/test_imagefmt.bad", &a).p);
+	}
+	TESTCASE("QOI images round-trip") {
+		/* NOTE: long runs, repeats of earlier colors for the index, small
+		 * and big steps, and alpha changes */
+		Image q = newimage(300, 40);
+		for (U32 y = 0; y < q.h; y++)
+			for (U32 x = 0; x < q.w; x++)
+				switch (y%5) {
+				case 0: PIXEL(&q, x, y) = x < 200 ? pal[1] : pal[y]; break;
+				case 1: PIXEL(&q, x, y) = pal[x%7]; break;
+				case 2: PIXEL(&q, x, y) = RGBA(x, x + 1, x - 1, 255); break;
+				case 3: PIXEL(&q, x, y) = RGBA(x*7, y, x*3, x); break;
+				case 4: PIXEL(&q, x, y) = rnd(); break;
+				}
+		Image b = (image2qoi(&big, "/tmp/test_imagefmt.qoi"), loadqoi("/tmp/test_imagefmt.qoi", &a));
+		Image r = (image2qoi(&q, "/tmp/test_imagefmt.qoi"), loadqoi("/tmp/test_imagefmt.qoi", &a));
+		REQUIRE(same(&big, &b) && same(&q, &r));
+		memfree(q.p);
+	}
+	TESTCASE("truncated QOI images don't load") {
+		OK ok = 1;
+		for (U64 n = 1; n < 12; n += 5) {
+			ok &= truncated("/tmp/test_imagefmt.bad", "/tmp/test_imagefmt.qoi", n);
+			ok &= !loadqoi("/tmp/test_imagefmt.bad", &a).p;
+		}
+		ok &= truncated("/tmp/test_imagefmt.bad", "/tmp/test_imagefmt.qoi", 0);
+		REQUIRE(ok && loadqoi("/tmp/test_imagefmt.bad", &a).p);
+	}
+	memfree(big.p);
+	memfree(small.p);
+	arfree(&a);
+}
@@ -29,6 +29,15 @@ TESTSUITE("math library") {
 		REQUIRE(divround(-6, -2) == 3);
 		REQUIRE(divround(7, 3) == 2);
 	}
+	TESTCASE("DIVFLOOR") {
+		REQUIRE(divfloor(5, 2) == 2);
+		REQUIRE(divfloor(-5, 2) == -3);
+		REQUIRE(divfloor(5, -2) == -3);
+		REQUIRE(divfloor(-5, -2) == 2);
+		REQUIRE(divfloor(6, 2) == 3);
+		REQUIRE(divfloor(-6, 2) == -3);
+		REQUIRE(divfloor(0, -3) == 0);
+	}
 	TESTCASE("lsb") {
 		REQUIRE(lsb((unsigned)0b1)    == 0b1);
 		REQUIRE(lsb((unsigned)0b10)   == 0b10);
@@ -6,7 +6,9 @@
 #include "ntime.h"
 #include "panic.h"
 #include "color.h"
+#include "conv.h"
 #include "image.h"
+#include "draw.h"
 #include "win.h"
 
 #define RMASK RGBA(0xFF, 0, 0, 0)
@@ -14,6 +16,7 @@
 #define BMASK RGBA(0, 0, 0xFF, 0)
 
 #define COUNT 256 /* keys/buttons */
+#define MAXRECTS 8 /* per partial flush */
 
 typedef struct {
 	Image fb;
@@ -37,6 +40,8 @@ typedef struct {
 	OK needswap;
 	Cursor invis;
 	OK mouselocked;
+	OK partial;
+	OK fullflush;
 } X11;
 
 static X11 defxwin;
@@ -56,6 +61,8 @@ static void onresize(U16 w, U16 h)
 	if (!w || !h)
 		return;
 	if (defxwin.i) {
+		if (defxwin.partial)
+			trackdamage(&defxwin.fb, 0);
 		XDestroyImage(defxwin.i);
 		XFreePixmap(defxwin.d, defxwin.bb);
 	}
@@ -65,6 +72,9 @@ static void onresize(U16 w, U16 h)
 	defxwin.fb.s = w;
 	defxwin.i = XCreateImage(defxwin.d, defxwin.vis, defxwin.depth, ZPixmap, 0, (char*)defxwin.fb.p, w, h, 32, 0);
 	defxwin.bb = XCreatePixmap(defxwin.d, defxwin.win, w, h, defxwin.depth);
+	if (defxwin.partial)
+		trackdamage(&defxwin.fb, 1);
+	defxwin.fullflush = 1;
 }
 
 static OK isrgb32(Display *d, Visual *v, int depth)
@@ -124,6 +134,16 @@ void winopen(U16 w, U16 h, const char *title, U16 fps)
 	onresize(w, h);
 }
 
+void partialflush(OK on)
+{
+	if (defxwin.partial == on)
+		return;
+	defxwin.partial = on;
+	if (defxwin.i)
+		trackdamage(&defxwin.fb, on);
+	defxwin.fullflush = 1;
+}
+
 void mouselock(OK on)
 {
 	defxwin.mouselocked = on;
@@ -181,17 +201,10 @@ I mousey(void)
 	return defxwin.mousey;
 }
 
-#define REVERSE4(x) (\
-	((x)&(0xFF<<(8*0)))<<(8*3)|\
-	((x)&(0xFF<<(8*1)))<<(8*1)|\
-	((x)&(0xFF<<(8*2)))>>(8*1)|\
-	((x)&(0xFF<<(8*3)))>>(8*3))
-
 static void swaprgb32(Image *i)
 {
-	for (I x = 0; x < i->w; x++)
-	for (I y = 0; y < i->h; y++)
-		PIXEL(i, x, y) = REVERSE4(PIXEL(i, x, y));
+	for (U16 y = 0; y < i->h; y++)
+		reversespan(&PIXEL(i, 0, y), &PIXEL(i, 0, y), i->w);
 }
 
 U64 lastframetime(void)
@@ -199,16 +212,40 @@ U64 lastframetime(void)
 	return defxwin.framens;
 }
 
-void flush(void)
+static void putrect(Rect r)
 {
-	if (!defxwin.i)
-		return;
+	I16 w = r.x1 - r.x0, h = r.y1 - r.y0;
+	Image sub = subimage(defxwin.fb, r.x0, r.y0, w, h);
 	if (defxwin.needswap)
 		/* NOTE: Xlib can actually do the swapping for us, if the image's
 		 * byte_order field doesn't match server's, but... */
-		swaprgb32(&defxwin.fb);
-	XPutImage(defxwin.d, defxwin.bb, defxwin.gc, defxwin.i, 0, 0, 0, 0, defxwin.fb.w, defxwin.fb.h);
-	XCopyArea(defxwin.d, defxwin.bb, defxwin.win, defxwin.gc, 0, 0, defxwin.fb.w, defxwin.fb.h, 0, 0);
+		swaprgb32(&sub);
+	XPutImage(defxwin.d, defxwin.bb, defxwin.gc, defxwin.i, r.x0, r.y0, r.x0, r.y0, w, h);
+	XCopyArea(defxwin.d, defxwin.bb, defxwin.win, defxwin.gc, r.x0, r.y0, w, h, r.x0, r.y0);
+	/* NOTE: the frame is not redrawn from scratch in the partial mode,
+	 * so the pixels have to be swapped back */
+	if (defxwin.needswap && defxwin.partial)
+		swaprgb32(&sub);
+}
+
+/* NOTE: the alpha is ignored here, so a premultiplied frame
+ * shows up as if it was composed over black. In the partial mode
+ * only the damaged parts of the frame get sent to the server. */
+void flush(void)
+{
+	if (!defxwin.i)
+		return;
+	Rect r[MAXRECTS];
+	I64 n = 0;
+	if (defxwin.partial)
+		n = drawdamage(&defxwin.fb, r, MAXRECTS);
+	if (!defxwin.partial || defxwin.fullflush) {
+		r[0] = (Rect){0, 0, defxwin.fb.w, defxwin.fb.h};
+		n = 1;
+	}
+	defxwin.fullflush = 0;
+	for (I64 k = 0; k < n; k++)
+		putrect(r[k]);
 	XSync(defxwin.d, 0);
 }
 
@@ -238,6 +275,10 @@ static void evpoll(void)
 			onbtn(e.xbutton.button, 1);
 		else if (e.type == ButtonRelease)
 			onbtn(e.xbutton.button, 0);
+		else if (e.type == Expose)
+			XCopyArea(defxwin.d, defxwin.bb, defxwin.win, defxwin.gc,
+				e.xexpose.x, e.xexpose.y, e.xexpose.width, e.xexpose.height,
+				e.xexpose.x, e.xexpose.y);
 	}
 	defxwin.framens = timens() - defxwin.startns;
 	if (defxwin.framens < defxwin.targetns)
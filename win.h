@@ -2,6 +2,8 @@ void   winopen(U16 w, U16 h, const char *title, U16 fps);
 void   winclose(void);
 Image* frame(void);
 void   flush(void);
+/* NOTE: upload only what the draw calls damaged since the last flush */
+void   partialflush(OK on);
 U64    lastframetime(void);
 OK     keyisdown(U8 k);
 OK     keywaspressed(U8 k);